@@ -0,0 +1,144 @@
+// writes the file and the key scripts the replay benchmarks run:
+//   text.c       a million lines of C
+//   typing.keys  code typed in the middle of it
+//   arrows.keys  the arrow and page keys held down
+//   paste.keys   a 4 MB bracketed paste, then undone
+//   save.keys    edits saved twice
+//   frames.keys  paging through on a big screen, typing between pages,
+//                so each key brings a whole new frame
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEXT_LINES 1000000
+#define MIDDLE "500000"
+
+static unsigned long seed = 1;
+
+// the same pseudo random numbers on every run and libc
+static unsigned next(unsigned n) {
+  seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+  return (seed >> 33) % n;
+}
+
+static const char *code[] = {
+  "int count = 0;",
+  "for (int i = 0; i < n; ++i) {",
+  "if (p == NULL) {",
+  "return total + offset;",
+  "printf(\"%d items\\n\", count);",
+  "// walk the list until the end",
+  "char *name = strdup(\"value\");",
+  "while (node != NULL && node->next != NULL) {",
+  "unsigned long size = sizeof(struct Row);",
+  "}",
+};
+
+static FILE *create(const char *dir, const char *name) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+  return f;
+}
+
+static void repeat(FILE *f, const char *keys, int n) {
+  for (int k = 0; k < n; ++k) {
+    fputs(keys, f);
+  }
+}
+
+static void code_line(FILE *f, const char *eol) {
+  fprintf(f, "%*s%s%s", (int) next(4) * 2, "", code[next(10)], eol);
+}
+
+static void gen_text(const char *dir) {
+  FILE *f = create(dir, "text.c");
+  for (int k = 0; k < TEXT_LINES; ++k) {
+    code_line(f, "\n");
+  }
+  fclose(f);
+}
+
+static void gen_typing(const char *dir) {
+  FILE *f = create(dir, "typing.keys");
+  fputs("\007" MIDDLE "\r", f); // ctrl-g to the middle
+
+  for (int k = 0; k < 100; ++k) {
+    const char *s = code[next(10)];
+    for (; *s; ++s) {
+      fputc(*s, f);
+      if (next(20) == 0) {
+        fputs("x\177", f); // a typo taken back
+      }
+    }
+    fputc('\r', f);
+  }
+  fputs("\030", f);
+  fclose(f);
+}
+
+static void gen_arrows(const char *dir) {
+  FILE *f = create(dir, "arrows.keys");
+  fputs("\007" MIDDLE "\r", f);
+  repeat(f, "\033[B", 2000);
+  repeat(f, "\033[C", 100);
+  repeat(f, "\033[A", 2000);
+  repeat(f, "\033[D", 100);
+  repeat(f, "\033[6~", 200);
+  repeat(f, "\033[5~", 200);
+  fputs("\030", f);
+  fclose(f);
+}
+
+static void gen_paste(const char *dir) {
+  FILE *f = create(dir, "paste.keys");
+  fputs("\007" MIDDLE "\r", f);
+  fputs("\033[200~", f);
+  for (int k = 0; k < 100000; ++k) {
+    code_line(f, "\r");
+  }
+  fputs("\033[201~", f);
+  fputs("\032", f); // and undo it
+  fputs("\030", f);
+  fclose(f);
+}
+
+static void gen_save(const char *dir) {
+  FILE *f = create(dir, "save.keys");
+  fputs("\007" MIDDLE "\r", f);
+  for (int k = 0; k < 2; ++k) {
+    fputs("saved ", f);
+    fputs("\023", f);
+  }
+  fputs("\030", f);
+  fclose(f);
+}
+
+static void gen_frames(const char *dir) {
+  FILE *f = create(dir, "frames.keys");
+  for (int k = 0; k < 1000; ++k) {
+    fputs(k % 2 ? "x" : "\033[6~", f);
+  }
+  fputs("\030n", f);
+  fclose(f);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s dir\n", argv[0]);
+    return 1;
+  }
+
+  gen_text(argv[1]);
+  gen_typing(argv[1]);
+  gen_arrows(argv[1]);
+  gen_paste(argv[1]);
+  gen_save(argv[1]);
+  gen_frames(argv[1]);
+  return 0;
+}
@@ -0,0 +1,504 @@
+// microbenchmarks of the editor core, driving the library without a
+// terminal and printing the results as json:
+//   bench_micro [DIR [MB...]]
+// First, on a 24x80 pty, it times what a frame costs before it draws
+//   frame_setup  the size looked up in terminfo on every frame, as it was;
+//                kept from the last SIGWINCH, as it is; and read again with
+//                TIOCGWINSZ after one, in microseconds a frame
+// For a generated C file of each size (1, 16 and 64 MB unless given) in
+// DIR (/tmp unless given) it times the cases below. Load from 1 MB to 2 GB
+// takes `bench_micro DIR 1 16 64 256 1024 2048`, with room for 2 GB in DIR
+// and memory for about 7 times the largest file, some 14 GB. It runs for a
+// long while, highlight_old mostly
+//   load       reading and indexing every line, in GB/s
+//   save       writing it out, in GB/s
+//   highlight_old  the strtok highlighter the lexer replaced, kept here as
+//              a reference, in spans and lines a second
+//   highlight  lexing every line with highlight_row, in spans and lines a
+//              second
+//   insert     chars typed at random places, a second
+//   delete     backspaces at random places, a second
+//   split      lines split with enter at random places, a second; each is a
+//              line insert into the tree, of about 2.3M lines at 64 MB
+//   join       lines joined by deleting their newline, a second
+// load, save and both highlights take the best of RUNS runs. Then, on a
+// file of REPLACE_MB, it times
+//   save       as above, so the saves reach past 100 MB by default
+//   replace    a regex replace over every line on 1, 2, 4... workers up to
+//              the cpus online, in lines a second
+#define _GNU_SOURCE // posix_openpt, ptsname_r
+
+#include <curses.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <term.h>
+#include <unistd.h>
+
+#include "editor.h"
+
+#define RUNS 3
+#define EDITS 200000
+#define SPLITS 20000
+#define REPLACE_MB 128
+#define FRAMES 5000
+
+static unsigned long seed = 1;
+
+// the same pseudo random numbers on every run and libc
+static unsigned long next(unsigned long n) {
+  seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+  return (seed >> 33) % n;
+}
+
+static const char *code[] = {
+  "int count = 0;",
+  "for (int i = 0; i < n; ++i) {",
+  "if (p == NULL) {",
+  "return total + offset;",
+  "printf(\"%d items\\n\", count);",
+  "// walk the list until the end",
+  "char *name = strdup(\"value\");",
+  "while (node != NULL && node->next != NULL) {",
+  "unsigned long size = sizeof(struct Row);",
+  "/* a comment that goes on",
+  "   to the next line */",
+  "}",
+};
+
+static int first = 1;
+
+static void result_name(const char *name) {
+  printf("%s    { \"name\": \"%s\"", first ? "" : ",\n", name);
+  first = 0;
+}
+
+static void result_start(const char *name, unsigned long mb) {
+  result_name(name);
+  printf(", \"mb\": %lu", mb);
+}
+
+// writes a file of at least bytes bytes, returning its size
+static unsigned long gen_text(const char *path, unsigned long bytes) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+
+  unsigned long n = 0;
+  while (n < bytes) {
+    n += fprintf(f, "%*s%s\n", (int) next(4) * 2, "", code[next(sizeof(code) / sizeof(code[0]))]);
+  }
+  fclose(f);
+  return n;
+}
+
+static void frame_result(const char *how, double ms) {
+  result_name("frame_setup");
+  printf(", \"size\": \"%s\", \"frames\": %d, \"ms\": %.3f, \"us_per_frame\": %.3f }",
+         how, FRAMES, ms, ms * 1e3 / FRAMES);
+}
+
+// a frame used to open the tty and load its terminfo entry to learn the
+// size; now the size is kept and only read with TIOCGWINSZ after a
+// SIGWINCH, so a frame starts with just the clear
+static void bench_frame_setup(void) {
+  const char *term = getenv("TERM") != NULL ? getenv("TERM") : "xterm-256color";
+  char tty[256];
+  int pty = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if (pty < 0 || grantpt(pty) < 0 || unlockpt(pty) < 0 || ptsname_r(pty, tty, sizeof(tty)) != 0) {
+    perror("pty");
+    exit(1);
+  }
+  int fd = open(tty, O_RDWR | O_NOCTTY);
+  struct winsize ws = { .ws_row = 24, .ws_col = 80 };
+  if (fd < 0 || ioctl(fd, TIOCSWINSZ, &ws) < 0) {
+    perror(tty);
+    exit(1);
+  }
+
+  struct Screen scr = { 0 };
+  screen_resize(&scr, ws.ws_row, ws.ws_col);
+
+  double start = now_ms();
+  for (int k = 0; k < FRAMES; ++k) {
+    int tty_fd = open(tty, O_RDWR | O_NOCTTY), err;
+    if (tty_fd < 0 || setupterm((char *) term, tty_fd, &err) == ERR) {
+      fprintf(stderr, "frame_setup: no terminfo entry for %s\n", term);
+      exit(1);
+    }
+    screen_resize(&scr, tigetnum((char *) "lines"), tigetnum((char *) "cols"));
+    del_curterm(cur_term); // it used to leak, freed here to keep memory flat
+    close(tty_fd);
+    screen_clear(&scr);
+  }
+  frame_result("terminfo", now_ms() - start);
+
+  start = now_ms();
+  for (int k = 0; k < FRAMES; ++k) {
+    screen_clear(&scr);
+  }
+  frame_result("kept", now_ms() - start);
+
+  // every frame a resize, one line more or less than the last
+  start = now_ms();
+  for (int k = 0; k < FRAMES; ++k) {
+    if (ioctl(fd, TIOCGWINSZ, &ws) < 0) {
+      perror(tty);
+      exit(1);
+    }
+    screen_resize(&scr, ws.ws_row + k % 2, ws.ws_col);
+    screen_clear(&scr);
+  }
+  frame_result("winch", now_ms() - start);
+
+  free(scr.front);
+  free(scr.back);
+  close(fd);
+  close(pty);
+}
+
+static struct Buffer *load(const char *path) {
+  struct Buffer *buf = malloc(sizeof(struct Buffer));
+  if (buf == NULL) {
+    fatal_err("can't allocate buffer");
+  }
+
+  buffer_init(buf);
+  buffer_read(buf, path);
+  buffer_index(buf, ULONG_MAX);
+  return buf;
+}
+
+static void bench_load(const char *path, unsigned long mb, unsigned long bytes) {
+  double best = 1e18;
+
+  for (int k = 0; k < RUNS; ++k) {
+    double start = now_ms();
+    struct Buffer *buf = load(path);
+    best = MIN(best, now_ms() - start);
+    Buffer_dealocate(buf);
+  }
+
+  result_start("load", mb);
+  printf(", \"bytes\": %lu, \"ms\": %.3f, \"gb_per_s\": %.3f }", bytes, best, bytes / 1e6 / MAX(best, 1e-3));
+}
+
+static void bench_save(const char *path, const char *out, unsigned long mb) {
+  struct Buffer *buf = load(path);
+  unsigned long bytes = 0;
+  double best = 1e18;
+
+  for (int k = 0; k < RUNS; ++k) {
+    double start = now_ms();
+    if (save_file(out, buf, &bytes) < 0) {
+      perror(out);
+      exit(1);
+    }
+    best = MIN(best, now_ms() - start);
+  }
+  unlink(out);
+  Buffer_dealocate(buf);
+
+  result_start("save", mb);
+  printf(", \"bytes\": %lu, \"ms\": %.3f, \"gb_per_s\": %.3f }", bytes, best, bytes / 1e6 / MAX(best, 1e-3));
+}
+
+// the highlighter as it was before highlight_row, for highlight_old: for
+// every char of a row it strdup()s the row, strtok()s the word starting
+// there and looks it up with a strcmp over each word list, which mallocs
+// its result. The old word lists are kept with it
+static const char *old_keywords[] = {
+  "while", "for", "if", "else", "switch", "case", "return"
+};
+
+static const char *old_data_types[] = {
+  "int", "float", "double", "char", "void", "unsigned", "long", "sizeof"
+};
+
+static const char *old_operands[] = {
+  "+", "-", "=", ";", "<", ">", "!", "%", "&", "|", "<<", ">>", "++", "--",
+  "+=", "-=", "/=", "*=", "<=", ">=", "==", "!=", "&&", "||"
+};
+
+// returns {length of highlight_word, highlight_type}
+static int *old_is_highlight(const char *word) {
+  int *ret = malloc(2 * sizeof(int));
+  for (size_t i = 0; i < sizeof(old_keywords) / sizeof(old_keywords[0]); ++i) {
+    if (strcmp(old_keywords[i], word) == 0) {
+      ret[0] = strlen(old_keywords[i]);
+      ret[1] = 0;
+      return ret;
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(old_data_types) / sizeof(old_data_types[0]); ++i) {
+    if (strcmp(old_data_types[i], word) == 0) {
+      ret[0] = strlen(old_data_types[i]);
+      ret[1] = 1;
+      return ret;
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(old_operands) / sizeof(old_operands[0]); ++i) {
+    if (strcmp(old_operands[i], word) == 0) {
+      ret[0] = strlen(old_operands[i]);
+      ret[1] = 2;
+      return ret;
+    }
+  }
+
+  free(ret);
+  return NULL;
+}
+
+// colors row into colors, one per char, returning the spans it started.
+// The loop is the old render_buf's, drawing into colors instead of the
+// screen; tok starts each char NULL where the old code left it unset, and
+// the result of a lookup is freed where the old code leaked it
+static unsigned long old_highlight_row(const char *row, size_t len, unsigned char *colors) {
+  unsigned long spans = 0;
+  unsigned chars_to_write = 0;
+  int color = HL_NORMAL;
+
+  for (size_t j = 0; j < len; ++j) {
+    char *cpyStr = strdup(row);
+    char *tok = NULL;
+    size_t tok_size = 0;
+
+    if (row[j] != ' ' && !tok_size) {
+      if (j == 0 || row[j - 1] == ' ') {
+        tok = strtok(cpyStr + j, " ");
+        tok_size = strlen(tok);
+      }
+    }
+
+    int highlight_size = 0;
+    int highlight_type = 0;
+
+    if (tok != NULL) {
+      int *key = old_is_highlight(tok);
+      if (key != NULL) {
+        highlight_size = key[0];
+        highlight_type = key[1];
+        free(key);
+      }
+    }
+
+    if (!chars_to_write && highlight_size) {
+      color = HL_KEYWORD + highlight_type;
+      chars_to_write = highlight_size;
+      spans++;
+    } else if (!chars_to_write) {
+      color = HL_NORMAL;
+    } else {
+      chars_to_write--;
+    }
+
+    colors[j] = color;
+    free(cpyStr);
+  }
+  return spans;
+}
+
+// the rows as the old buffer kept them, one string each, so only the
+// highlighting is timed
+static void bench_highlight_old(const char *path, unsigned long mb) {
+  struct Buffer *buf = load(path);
+  unsigned long rows = buf->size, spans = 0;
+  char **text = malloc(rows * sizeof(char *));
+  size_t *lens = malloc(rows * sizeof(size_t)), max = 1;
+  struct LineIter it;
+  unsigned long i = 0;
+
+  if (text == NULL || lens == NULL) {
+    fatal_err("can't allocate rows");
+  }
+  for (struct Line *line = line_iter_start(buf, 0, &it); line != NULL; line = line_iter_next(&it), ++i) {
+    struct RowText t = row_text(&line->row);
+    lens[i] = t.alen + t.blen;
+    if ((text[i] = malloc(lens[i] + 1)) == NULL) {
+      fatal_err("can't allocate rows");
+    }
+    memcpy(text[i], t.a, t.alen);
+    memcpy(text[i] + t.alen, t.b, t.blen);
+    text[i][lens[i]] = 0;
+    max = MAX(max, lens[i]);
+  }
+  Buffer_dealocate(buf);
+
+  unsigned char *colors = malloc(max);
+  double best = 1e18;
+  if (colors == NULL) {
+    fatal_err("can't allocate colors");
+  }
+  for (int k = 0; k < RUNS; ++k) {
+    double start = now_ms();
+    spans = 0;
+    for (i = 0; i < rows; ++i) {
+      spans += old_highlight_row(text[i], lens[i], colors);
+    }
+    best = MIN(best, now_ms() - start);
+  }
+
+  for (i = 0; i < rows; ++i) {
+    free(text[i]);
+  }
+  free(text);
+  free(lens);
+  free(colors);
+
+  result_start("highlight_old", mb);
+  printf(", \"lines\": %lu, \"spans\": %lu, \"ms\": %.3f, \"spans_per_s\": %.0f, \"lines_per_s\": %.0f }",
+         rows, spans, best, spans / MAX(best, 1e-3) * 1e3, rows / MAX(best, 1e-3) * 1e3);
+}
+
+static void bench_highlight(const char *path, unsigned long mb) {
+  unsigned long rows = 0, spans = 0;
+  double best = 1e18;
+
+  for (int k = 0; k < RUNS; ++k) {
+    struct Buffer *buf = load(path);
+    double start = now_ms();
+    highlight_update(buf, 0, buf->size - 1);
+    best = MIN(best, now_ms() - start);
+
+    struct LineIter it;
+    rows = buf->size;
+    spans = 0;
+    for (struct Line *line = line_iter_start(buf, 0, &it); line != NULL; line = line_iter_next(&it)) {
+      spans += line->hl.nspans;
+    }
+    Buffer_dealocate(buf);
+  }
+
+  result_start("highlight", mb);
+  printf(", \"lines\": %lu, \"spans\": %lu, \"ms\": %.3f, \"spans_per_s\": %.0f, \"lines_per_s\": %.0f }",
+         rows, spans, best, spans / MAX(best, 1e-3) * 1e3, rows / MAX(best, 1e-3) * 1e3);
+}
+
+// puts the cursor at a random place, for a backspace or enter somewhere
+// past the start of the line if after is set
+static void cursor_random(struct Buffer *buf, int after) {
+  buf->cx = next(buf->size);
+  unsigned long len = row_len(&buffer_line(buf, buf->cx)->row);
+  buf->cy = after && len > 0 ? 1 + next(len) : next(len + 1);
+}
+
+static void edit_result(const char *name, unsigned long mb, unsigned long ops, double ms) {
+  result_start(name, mb);
+  printf(", \"ops\": %lu, \"ms\": %.3f, \"ops_per_s\": %.0f }", ops, ms, ops / MAX(ms, 1e-3) * 1e3);
+}
+
+// every edit goes through the undo journal. Inserts, deletes and splits
+// go through buffer_write, as typing does; joins through edit_delete at the
+// end of a line, as the delete key does, since buffer_write has no forward
+// delete and a backspace at the start of a line doesn't join
+static void bench_edits(const char *path, unsigned long mb) {
+  struct Buffer *buf = load(path);
+  unsigned long ops = 0;
+  double start = now_ms();
+
+  for (int k = 0; k < EDITS; ++k) {
+    cursor_random(buf, 0);
+    buffer_write(buf, 'a' + k % 26);
+  }
+  edit_result("insert", mb, EDITS, now_ms() - start);
+
+  start = now_ms();
+  for (int k = 0; k < EDITS; ++k) {
+    cursor_random(buf, 1);
+    if (buf->cy > 0) {
+      buffer_write(buf, 127);
+      ops++;
+    }
+  }
+  edit_result("delete", mb, ops, now_ms() - start);
+
+  start = now_ms();
+  for (int k = 0; k < SPLITS; ++k) {
+    cursor_random(buf, 0);
+    buffer_write(buf, '\r');
+  }
+  edit_result("split", mb, SPLITS, now_ms() - start);
+
+  start = now_ms();
+  for (int k = 0; k < SPLITS; ++k) {
+    buf->cx = next(buf->size - 1);
+    buf->cy = row_len(&buffer_line(buf, buf->cx)->row);
+    edit_delete(buf, buf->cx, buf->cy, 1);
+  }
+  edit_result("join", mb, SPLITS, now_ms() - start);
+
+  Buffer_dealocate(buf);
+}
+
+// the file is loaded afresh for each worker count, as a replace changes it
+static void bench_replace(const char *path, unsigned long mb) {
+  long cpus = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+  char err[200];
+
+  for (long jobs = 1;; jobs = MIN(jobs * 2, cpus)) {
+    struct Buffer *buf = load(path);
+    unsigned long rows = buf->size;
+    double start = now_ms();
+    long n = buffer_replace(buf, "n(ode|ame)", "item", jobs, err, sizeof(err));
+    double ms = now_ms() - start;
+    Buffer_dealocate(buf);
+
+    if (n < 0) {
+      fprintf(stderr, "replace: %s\n", err);
+      exit(1);
+    }
+    result_start("replace", mb);
+    printf(", \"lines\": %lu, \"jobs\": %ld, \"matches\": %ld, \"ms\": %.3f, \"lines_per_s\": %.0f }",
+           rows, jobs, n, ms, rows / MAX(ms, 1e-3) * 1e3);
+    fflush(stdout);
+    if (jobs == cpus) {
+      break;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  static const unsigned long sizes[] = { 1, 16, 64 };
+  const char *dir = argc > 1 ? argv[1] : "/tmp";
+  char path[4096], out[4096];
+
+  hl_init();
+  newline_scan_init();
+  text_find_init();
+
+  printf("{\n  \"benchmarks\": [\n");
+  bench_frame_setup();
+  fflush(stdout);
+  for (int k = 0; k < (argc > 2 ? argc - 2 : 3); ++k) {
+    unsigned long mb = argc > 2 ? strtoul(argv[k + 2], NULL, 10) : sizes[k];
+
+    snprintf(path, sizeof(path), "%s/micro_%lu.c", dir, mb);
+    snprintf(out, sizeof(out), "%s/micro_%lu.out.c", dir, mb);
+    unsigned long bytes = gen_text(path, mb << 20);
+
+    bench_load(path, mb, bytes);
+    bench_save(path, out, mb);
+    bench_highlight_old(path, mb);
+    bench_highlight(path, mb);
+    bench_edits(path, mb);
+    unlink(path);
+    fflush(stdout);
+  }
+
+  snprintf(path, sizeof(path), "%s/micro_replace.c", dir);
+  snprintf(out, sizeof(out), "%s/micro_replace.out.c", dir);
+  gen_text(path, (unsigned long) REPLACE_MB << 20);
+  bench_save(path, out, REPLACE_MB);
+  bench_replace(path, REPLACE_MB);
+  unlink(path);
+  printf("\n  ]\n}\n");
+  return 0;
+}
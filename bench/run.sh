@@ -0,0 +1,25 @@
+#!/bin/sh
+# runs the replay benchmarks: run.sh EDITOR GEN DIR
+# Each scenario prints its key latency, bytes per frame and peak RSS
+set -e
+
+editor=$1
+gen=$2
+dir=$3
+
+mkdir -p "$dir"
+"$gen" "$dir"
+
+for s in typing arrows paste save; do
+  cp "$dir/text.c" "$dir/$s.c"
+  TERM=xterm-256color "$editor" --replay "$dir/$s.keys" --size 120x40 "$dir/$s.c" > /dev/null
+  rm -f "$dir/$s.c"
+done
+
+# the same keys with the frames written inline and from the render
+# thread, on a screen big enough that writing a frame costs something
+for r in "" --render-thread; do
+  cp "$dir/text.c" "$dir/frames.c"
+  TERM=xterm-256color "$editor" --replay "$dir/frames.keys" --size 400x120 $r "$dir/frames.c" > /dev/null
+  rm -f "$dir/frames.c"
+done
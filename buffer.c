@@ -0,0 +1,1631 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "editor.h"
+
+#define ROW_MIN_SIZE 16
+#define SAVE_IOV_MAX 1024
+#define UNDO_CHUNK_SIZE 65536
+#define UNDO_MAX_BYTES (64UL << 20)
+#define INDEX_BLOCK (1 << 18)
+#define INDEX_BATCH 4096
+#define REPLACE_CHUNK 4096
+
+enum undo_type {
+  UNDO_INSERT,
+  UNDO_DELETE
+};
+
+// an edit in the undo journal. Its text follows it, then the offset the
+// record starts at, so the journal can be walked both ways
+struct UndoRec {
+  unsigned long line, col; // where the text was inserted or deleted
+  unsigned long len;
+  unsigned long group;     // records of a group are undone together
+  int type;
+};
+
+// the journal is kept in chunks appended as it grows; a record never
+// spans chunks, one too big for a chunk gets a chunk of its own
+struct UndoChunk {
+  struct UndoChunk *prev, *next;
+  unsigned long size;
+  unsigned long used;
+  unsigned long start; // the first record still kept, past a group cut by eviction
+  long data[]; // records, aligned for struct UndoRec
+};
+
+// the spans of a save are gathered here and written with one writev
+struct SaveBatch {
+  int fd;
+  struct iovec iov[SAVE_IOV_MAX];
+  int n;
+  unsigned long bytes; // written so far
+  int err;
+};
+
+unsigned long row_len(const struct Row *row) {
+  return row->cap - (row->gap_end - row->gap);
+}
+
+// the row's text as the two runs around the gap, without copying it
+struct RowText row_text(const struct Row *row) {
+  struct RowText t;
+  t.a = row->data;
+  t.alen = row->gap;
+  t.b = row->data + row->gap_end;
+  t.blen = row->cap - row->gap_end;
+  return t;
+}
+
+// copies n chars of t starting at from into dst
+void rt_copy(const struct RowText *t, unsigned long from, unsigned long n, char *dst) {
+  if (from < t->alen) {
+    unsigned long k = MIN(n, t->alen - from);
+    memcpy(dst, t->a + from, k);
+    dst += k;
+    n -= k;
+    from = t->alen;
+  }
+  memcpy(dst, t->b + from - t->alen, n);
+}
+
+// copies a mapped row into memory of its own so it can be edited
+static void row_own(struct Row *row) {
+  unsigned long len = row->cap;
+  char *data = malloc(MAX(len, 1UL));
+  if (data == NULL) {
+    fatal_err("can't allocate row");
+  }
+
+  memcpy(data, row->data, len);
+  row->data = data;
+  row->mapped = 0;
+}
+
+static void row_move_gap(struct Row *row, unsigned long pos) {
+  if (row->mapped) {
+    row_own(row);
+  }
+
+  if (pos < row->gap) {
+    unsigned long n = row->gap - pos;
+    memmove(row->data + row->gap_end - n, row->data + pos, n);
+    row->gap -= n;
+    row->gap_end -= n;
+  } else if (pos > row->gap) {
+    unsigned long n = pos - row->gap;
+    memmove(row->data + row->gap, row->data + row->gap_end, n);
+    row->gap += n;
+    row->gap_end += n;
+  }
+}
+
+// makes room for at least n more chars, growing the row geometrically
+static void row_reserve(struct Row *row, unsigned long n) {
+  if (row->mapped) {
+    row_own(row);
+  }
+
+  if (row->gap_end - row->gap >= n) {
+    return;
+  }
+
+  unsigned long len = row_len(row);
+  unsigned long tail = row->cap - row->gap_end;
+  unsigned long cap = MAX(row->cap * 2, (unsigned long) ROW_MIN_SIZE);
+  while (cap < len + n) {
+    cap *= 2;
+  }
+
+  row->data = realloc(row->data, cap);
+  if (row->data == NULL) {
+    fatal_err("can't grow row");
+  }
+
+  memmove(row->data + cap - tail, row->data + row->gap_end, tail);
+  row->gap_end = cap - tail;
+  row->cap = cap;
+}
+
+void row_insert(struct Row *row, unsigned long pos, const char *s, unsigned long n) {
+  row_reserve(row, n);
+  row_move_gap(row, pos);
+  memcpy(row->data + row->gap, s, n);
+  row->gap += n;
+}
+
+void row_delete(struct Row *row, unsigned long pos, unsigned long n) {
+  row_move_gap(row, pos);
+  row->gap_end += n;
+}
+
+// sets the row to the n chars at s, with the gap at the end
+void row_init(struct Row *row, const char *s, unsigned long n) {
+  row->data = malloc(MAX(n, 1UL));
+  if (row->data == NULL) {
+    fatal_err("can't allocate row");
+  }
+
+  memcpy(row->data, s, n);
+  row->gap = row->gap_end = row->cap = n;
+  row->mapped = 0;
+}
+
+// points the row at the n chars at s in the file mapping
+void row_map(struct Row *row, const char *s, unsigned long n) {
+  row->data = (char *) s;
+  row->gap = row->gap_end = row->cap = n;
+  row->mapped = 1;
+}
+
+void row_free(struct Row *row) {
+  if (!row->mapped) {
+    free(row->data);
+  }
+  row->data = NULL;
+  row->gap = row->gap_end = row->cap = 0;
+  row->mapped = 0;
+}
+
+static struct LineNode *node_new(int leaf) {
+  struct LineNode *node = calloc(1, sizeof(struct LineNode));
+  if (node == NULL) {
+    fatal_err("can't allocate line tree node");
+  }
+
+  node->leaf = leaf;
+  return node;
+}
+
+// adds to the line and byte counts of node and all its ancestors
+static void node_add(struct LineNode *node, long nlines, long nbytes) {
+  for (; node != NULL; node = node->parent) {
+    node->nlines += nlines;
+    node->nbytes += nbytes;
+  }
+}
+
+static void node_recount(struct LineNode *node) {
+  node->nlines = 0;
+  node->nbytes = 0;
+
+  for (int k = 0; k < node->n; ++k) {
+    if (node->leaf) {
+      node->nlines++;
+      node->nbytes += row_len(&node->line[k].row) + 1;
+    } else {
+      node->nlines += node->child[k]->nlines;
+      node->nbytes += node->child[k]->nbytes;
+    }
+  }
+}
+
+static int node_index(const struct LineNode *parent, const struct LineNode *child) {
+  int k = 0;
+  while (parent->child[k] != child) {
+    k++;
+  }
+  return k;
+}
+
+// moves the entries of node from split on into a new sibling; appending
+// splits off only the last entry so bulk loads leave nodes full
+static struct LineNode *node_split(struct LineNode *node, int split) {
+  struct LineNode *sibling = node_new(node->leaf);
+  int moved = node->n - split;
+
+  if (node->leaf) {
+    memcpy(sibling->line, node->line + split, moved * sizeof(struct Line));
+
+    sibling->next = node->next;
+    sibling->prev = node;
+    if (node->next != NULL) {
+      node->next->prev = sibling;
+    }
+    node->next = sibling;
+  } else {
+    memcpy(sibling->child, node->child + split, moved * sizeof(struct LineNode *));
+    for (int k = 0; k < moved; ++k) {
+      sibling->child[k]->parent = sibling;
+    }
+  }
+
+  node->n = split;
+  sibling->n = moved;
+  node_recount(node);
+  node_recount(sibling);
+  return sibling;
+}
+
+// puts sibling right after node in node's parent, splitting upwards
+static void node_insert_after(struct Buffer *buf, struct LineNode *node,
+                              struct LineNode *sibling) {
+  struct LineNode *parent = node->parent;
+
+  if (parent == NULL) {
+    parent = node_new(0);
+    parent->child[0] = node;
+    parent->child[1] = sibling;
+    parent->n = 2;
+    node->parent = sibling->parent = parent;
+    node_recount(parent);
+    buf->tree = parent;
+    return;
+  }
+
+  // the parent's counts stay right, node and sibling hold what node held
+  int k = node_index(parent, node) + 1;
+  memmove(parent->child + k + 1, parent->child + k, (parent->n - k) * sizeof(struct LineNode *));
+  parent->child[k] = sibling;
+  sibling->parent = parent;
+  parent->n++;
+
+  if (parent->n > LINE_NODE_MAX) {
+    int split = k == parent->n - 1 ? parent->n - 1 : parent->n / 2;
+    node_insert_after(buf, parent, node_split(parent, split));
+  }
+}
+
+// finds the leaf holding line i and the index of the line in it; i may be
+// buf->size to find where a line appended at the end goes
+static struct LineNode *line_find(const struct Buffer *buf, unsigned long i, int *idx) {
+  struct LineNode *node = buf->tree;
+
+  while (!node->leaf) {
+    int k = 0;
+    while (k < node->n - 1 && i >= node->child[k]->nlines) {
+      i -= node->child[k]->nlines;
+      k++;
+    }
+    node = node->child[k];
+  }
+
+  *idx = i;
+  return node;
+}
+
+struct Line *buffer_line(const struct Buffer *buf, unsigned long i) {
+  int idx;
+  struct LineNode *leaf = line_find(buf, i, &idx);
+  return &leaf->line[idx];
+}
+
+// inserts an empty line before line i and returns it. Like every pointer
+// into the tree it stays valid only until lines are inserted or deleted
+struct Line *buffer_insert_line(struct Buffer *buf, unsigned long i) {
+  int idx;
+  struct LineNode *leaf = line_find(buf, i, &idx);
+
+  memmove(leaf->line + idx + 1, leaf->line + idx, (leaf->n - idx) * sizeof(struct Line));
+  memset(&leaf->line[idx], 0, sizeof(struct Line));
+  leaf->n++;
+  node_add(leaf, 1, 1);
+  buf->size++;
+
+  // the lines below moved down, the new one needs lexing
+  if (buf->hl_dirty_max >= (long) i) {
+    buf->hl_dirty_max++;
+  }
+  buf->hl_upto = MIN(buf->hl_upto, i);
+  buf->hl_dirty_max = MAX(buf->hl_dirty_max, (long) i);
+
+  if (leaf->n > LINE_LEAF_MAX) {
+    int split = idx == leaf->n - 1 ? leaf->n - 1 : leaf->n / 2;
+    struct LineNode *sibling = node_split(leaf, split);
+    node_insert_after(buf, leaf, sibling);
+
+    if (idx >= split) {
+      return &sibling->line[idx - split];
+    }
+  }
+
+  return &leaf->line[idx];
+}
+
+void buffer_delete_line(struct Buffer *buf, unsigned long i) {
+  int idx;
+  struct LineNode *node = line_find(buf, i, &idx);
+  struct Line *line = &node->line[idx];
+
+  node_add(node, -1, -(long) (row_len(&line->row) + 1));
+  row_free(&line->row);
+  free(line->hl.spans);
+  free(line->cols);
+  free(line->wrap);
+
+  memmove(node->line + idx, node->line + idx + 1, (node->n - idx - 1) * sizeof(struct Line));
+  node->n--;
+  buf->size--;
+
+  // the line now at i may start in another lexer state
+  if (buf->hl_dirty_max > (long) i) {
+    buf->hl_dirty_max--;
+  }
+  buf->hl_upto = MIN(buf->hl_upto, i);
+
+  // drop nodes left empty, keeping at least an empty root leaf
+  while (node->n == 0 && node->parent != NULL) {
+    struct LineNode *parent = node->parent;
+    int k = node_index(parent, node);
+
+    if (node->leaf) {
+      if (node->prev != NULL) {
+        node->prev->next = node->next;
+      }
+      if (node->next != NULL) {
+        node->next->prev = node->prev;
+      }
+    }
+
+    memmove(parent->child + k, parent->child + k + 1, (parent->n - k - 1) * sizeof(struct LineNode *));
+    parent->n--;
+    free(node);
+    node = parent;
+  }
+
+  while (!buf->tree->leaf && buf->tree->n == 1) {
+    struct LineNode *root = buf->tree;
+    buf->tree = root->child[0];
+    buf->tree->parent = NULL;
+    free(root);
+  }
+}
+
+// byte offset of the start of line i, counting one byte per newline
+unsigned long buffer_line_offset(const struct Buffer *buf, unsigned long i) {
+  const struct LineNode *node = buf->tree;
+  unsigned long offset = 0;
+
+  while (!node->leaf) {
+    int k = 0;
+    while (k < node->n - 1 && i >= node->child[k]->nlines) {
+      i -= node->child[k]->nlines;
+      offset += node->child[k]->nbytes;
+      k++;
+    }
+    node = node->child[k];
+  }
+
+  for (int k = 0; k < i; ++k) {
+    offset += row_len(&node->line[k].row) + 1;
+  }
+  return offset;
+}
+
+// inserts n chars of s at pos of line i
+void line_insert_text(struct Buffer *buf, unsigned long i, unsigned long pos,
+                      const char *s, unsigned long n) {
+  int idx;
+  struct LineNode *leaf = line_find(buf, i, &idx);
+
+  row_insert(&leaf->line[idx].row, pos, s, n);
+  line_cols_edit(&leaf->line[idx], pos, 0, n);
+  line_wrap_edit(&leaf->line[idx], pos);
+  node_add(leaf, 0, n);
+  highlight_invalidate(buf, i);
+}
+
+// deletes n chars at pos of line i
+void line_delete_text(struct Buffer *buf, unsigned long i, unsigned long pos,
+                      unsigned long n) {
+  int idx;
+  struct LineNode *leaf = line_find(buf, i, &idx);
+
+  row_delete(&leaf->line[idx].row, pos, n);
+  line_cols_edit(&leaf->line[idx], pos, n, 0);
+  line_wrap_edit(&leaf->line[idx], pos);
+  node_add(leaf, 0, -(long) n);
+  highlight_invalidate(buf, i);
+}
+
+// replaces the n chars at pos of line i with the m chars at s, building
+// the row afresh in one allocation
+void line_replace_text(struct Buffer *buf, unsigned long i, unsigned long pos, unsigned long n,
+                       const char *s, unsigned long m) {
+  int idx;
+  struct LineNode *leaf = line_find(buf, i, &idx);
+  struct Row *row = &leaf->line[idx].row;
+  struct RowText t = row_text(row);
+  unsigned long len = t.alen + t.blen;
+  unsigned long cap = MAX(len - n + m, (unsigned long) ROW_MIN_SIZE);
+  char *data = malloc(cap);
+
+  if (data == NULL) {
+    fatal_err("can't grow row");
+  }
+
+  rt_copy(&t, 0, pos, data);
+  memcpy(data + pos, s, m);
+  rt_copy(&t, pos + n, len - pos - n, data + pos + m);
+
+  row_free(row);
+  row->data = data;
+  row->gap = len - n + m;
+  row->gap_end = row->cap = cap;
+  line_cols_edit(&leaf->line[idx], pos, n, m);
+  line_wrap_edit(&leaf->line[idx], pos);
+
+  node_add(leaf, 0, (long) m - (long) n);
+  highlight_invalidate(buf, i);
+}
+
+// starts iterating the lines at line i, returning it
+struct Line *line_iter_start(const struct Buffer *buf, unsigned long i, struct LineIter *it) {
+  if (i >= buf->size) {
+    it->leaf = NULL;
+    return NULL;
+  }
+
+  it->leaf = line_find(buf, i, &it->idx);
+  return &it->leaf->line[it->idx];
+}
+
+struct Line *line_iter_next(struct LineIter *it) {
+  if (it->leaf == NULL) {
+    return NULL;
+  }
+
+  if (++it->idx >= it->leaf->n) {
+    it->leaf = it->leaf->next;
+    it->idx = 0;
+    if (it->leaf == NULL) {
+      return NULL;
+    }
+  }
+  return &it->leaf->line[it->idx];
+}
+
+struct Line *line_iter_prev(struct LineIter *it) {
+  if (it->leaf == NULL) {
+    return NULL;
+  }
+
+  if (--it->idx < 0) {
+    it->leaf = it->leaf->prev;
+    if (it->leaf == NULL) {
+      return NULL;
+    }
+    it->idx = it->leaf->n - 1;
+  }
+  return &it->leaf->line[it->idx];
+}
+
+// the newline scanners store the offsets of the first newlines in s[0..n),
+// at most max of them, in pos and return how many they found
+static int newline_scan_scalar(const char *s, unsigned long n, unsigned long *pos, int max) {
+  const char *p = s, *end = s + n;
+  int found = 0;
+
+  while (found < max && (p = memchr(p, '\n', end - p)) != NULL) {
+    pos[found++] = p++ - s;
+  }
+  return found;
+}
+
+// finishes a vector scan stopped at i with the scalar one
+static int newline_scan_tail(const char *s, unsigned long n, unsigned long i,
+                             unsigned long *pos, int found, int max) {
+  int k = found;
+
+  found += newline_scan_scalar(s + i, n - i, pos + found, max - found);
+  for (; k < found; ++k) {
+    pos[k] += i;
+  }
+  return found;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static int newline_scan_sse2(const char *s, unsigned long n, unsigned long *pos, int max) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  unsigned long i = 0;
+  int found = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+    for (; mask != 0; mask &= mask - 1) {
+      pos[found++] = i + __builtin_ctz(mask);
+      if (found == max) {
+        return found;
+      }
+    }
+  }
+  return newline_scan_tail(s, n, i, pos, found, max);
+}
+
+__attribute__((target("avx2")))
+static int newline_scan_avx2(const char *s, unsigned long n, unsigned long *pos, int max) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  unsigned long i = 0;
+  int found = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+
+    for (; mask != 0; mask &= mask - 1) {
+      pos[found++] = i + __builtin_ctz(mask);
+      if (found == max) {
+        return found;
+      }
+    }
+  }
+  return newline_scan_tail(s, n, i, pos, found, max);
+}
+#endif
+
+int (*newline_scan)(const char *, unsigned long, unsigned long *, int) = newline_scan_scalar;
+
+// picks the widest newline scanner the cpu runs
+void newline_scan_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    newline_scan = newline_scan_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    newline_scan = newline_scan_sse2;
+  }
+#endif
+}
+
+// counts the newlines in s[0..n)
+unsigned long newline_count(const char *s, unsigned long n) {
+  unsigned long pos[INDEX_BATCH], count = 0;
+  int found;
+
+  while ((found = newline_scan(s, n, pos, INDEX_BATCH)) == INDEX_BATCH) {
+    count += found;
+    n -= pos[found - 1] + 1;
+    s += pos[found - 1] + 1;
+  }
+  return count + found;
+}
+
+// appends the mapped line from buf->map_next up to end
+static void buffer_index_line(struct Buffer *buf, unsigned long end) {
+  const char *start = buf->map + buf->map_next;
+  unsigned long len = end - buf->map_next;
+
+  if (buf->crlf && len > 0 && start[len - 1] == '\r' && end < buf->map_len) {
+    len--;
+  }
+  buf->map_next = end + 1;
+
+  // lines are appended, so while the last leaf has room they go straight in
+  struct LineNode *leaf = buf->tree;
+  while (!leaf->leaf) {
+    leaf = leaf->child[leaf->n - 1];
+  }
+
+  if (leaf->n < LINE_LEAF_MAX) {
+    struct Line *line = &leaf->line[leaf->n++];
+    memset(line, 0, sizeof(struct Line));
+    row_map(&line->row, start, len);
+    node_add(leaf, 1, len + 1);
+    buf->size++;
+    return;
+  }
+
+  int idx;
+  row_map(&buffer_insert_line(buf, buf->size)->row, start, len);
+  node_add(line_find(buf, buf->size - 1, &idx), 0, len);
+}
+
+// splits lines off the file mapping until there are n lines or the file
+// runs out. Lines are indexed only once something asks for them, so
+// opening a huge file reads just the pages that get shown
+void buffer_index(struct Buffer *buf, unsigned long n) {
+  unsigned long pos[INDEX_BATCH];
+  unsigned long from = buf->map_next; // no newlines between map_next and here
+
+  while (buf->size < n && !buf->indexed) {
+    unsigned long block = MIN((unsigned long) INDEX_BLOCK, buf->map_len - from);
+    int max = MIN(n - buf->size, (unsigned long) INDEX_BATCH);
+    int found = newline_scan(buf->map + from, block, pos, max);
+
+    for (int k = 0; k < found; ++k) {
+      buffer_index_line(buf, from + pos[k]);
+    }
+
+    if (found == max) {
+      from = buf->map_next;
+    } else if ((from += block) == buf->map_len) {
+      // the last line has no newline after it
+      buffer_index_line(buf, buf->map_len);
+      buf->indexed = 1;
+    }
+  }
+}
+
+static void lines_free(struct LineNode *node) {
+  for (int k = 0; k < node->n; ++k) {
+    if (node->leaf) {
+      row_free(&node->line[k].row);
+      free(node->line[k].hl.spans);
+      free(node->line[k].cols);
+      free(node->line[k].wrap);
+    } else {
+      lines_free(node->child[k]);
+    }
+  }
+  free(node);
+}
+
+// inserts the n chars at s, newlines included, at column col of line r
+// and returns where the inserted text ends in *end_r and *end_c
+void buffer_insert(struct Buffer *buf, unsigned long r, unsigned long col,
+                   const char *s, unsigned long n,
+                   unsigned long *end_r, unsigned long *end_c) {
+  const char *nl = memchr(s, '\n', n);
+
+  journal_edit(r, col, 0, s, n);
+
+  if (nl == NULL) {
+    line_insert_text(buf, r, col, s, n);
+    *end_r = r;
+    *end_c = col + n;
+    return;
+  }
+
+  // every newline starts a line; the last one gets what followed col
+  unsigned long first = nl - s;
+  unsigned long k = r;
+  const char *p = nl + 1, *end = s + n;
+
+  while (p <= end) {
+    const char *next = memchr(p, '\n', end - p);
+    unsigned long len = (next ? next : end) - p;
+
+    buffer_insert_line(buf, ++k);
+    line_insert_text(buf, k, 0, p, len);
+    *end_c = len;
+    p += len + 1;
+  }
+  *end_r = k;
+
+  struct Line *line = buffer_line(buf, r);
+  unsigned long tail = row_len(&line->row) - col;
+  row_move_gap(&line->row, col);
+  line_insert_text(buf, k, *end_c, line->row.data + line->row.gap_end, tail);
+  line_delete_text(buf, r, col, tail);
+  line_insert_text(buf, r, col, s, first);
+}
+
+// deletes n chars, newlines included, from column col of line r
+void buffer_delete(struct Buffer *buf, unsigned long r, unsigned long col, unsigned long n) {
+  unsigned long len = row_len(&buffer_line(buf, r)->row);
+
+  journal_edit(r, col, n, NULL, 0);
+
+  if (col + n <= len) {
+    line_delete_text(buf, r, col, n);
+    return;
+  }
+
+  // past the end of line r: drop the lines wholly deleted, then join
+  // what is left of the last one onto line r
+  line_delete_text(buf, r, col, len - col);
+  n -= len - col + 1;
+
+  buffer_index(buf, r + 2);
+  while (r + 1 < buf->size && n > (len = row_len(&buffer_line(buf, r + 1)->row))) {
+    buffer_delete_line(buf, r + 1);
+    n -= len + 1;
+    buffer_index(buf, r + 2);
+  }
+
+  if (r + 1 < buf->size) {
+    struct Line *next = buffer_line(buf, r + 1);
+    struct RowText t = row_text(&next->row);
+    unsigned long rest = t.alen + t.blen - n;
+
+    row_move_gap(&next->row, n);
+    line_insert_text(buf, r, col, next->row.data + next->row.gap_end, rest);
+    buffer_delete_line(buf, r + 1);
+  }
+}
+
+// copies the n chars, newlines included, from column col of line r
+void buffer_copy(struct Buffer *buf, unsigned long r, unsigned long col,
+                 unsigned long n, char *dst) {
+  for (; n > 0; ++r) {
+    buffer_index(buf, r + 1);
+    if (r >= buf->size) {
+      break;
+    }
+
+    struct RowText t = row_text(&buffer_line(buf, r)->row);
+    unsigned long k = MIN(n, t.alen + t.blen - col);
+
+    rt_copy(&t, col, k, dst);
+    dst += k;
+    n -= k;
+    col = 0;
+
+    if (n > 0) {
+      *dst++ = '\n';
+      n--;
+    }
+  }
+}
+
+static unsigned long undo_rec_size(unsigned long len) {
+  unsigned long n = sizeof(struct UndoRec) + len;
+  return (n + sizeof(long) - 1) / sizeof(long) * sizeof(long) + sizeof(long);
+}
+
+static struct UndoRec *undo_rec_at(struct UndoChunk *chunk, unsigned long off) {
+  return (struct UndoRec *) ((char *) chunk->data + off);
+}
+
+// the applied record before the journal position, moving the position to
+// its start; NULL at the start of the journal
+static struct UndoRec *undo_prev(struct Undo *u) {
+  while (u->chunk != NULL && u->pos == u->chunk->start && u->chunk->prev != NULL) {
+    u->chunk = u->chunk->prev;
+    u->pos = u->chunk->used;
+  }
+  if (u->chunk == NULL || u->pos == u->chunk->start) {
+    return NULL;
+  }
+
+  u->pos = *(long *) ((char *) u->chunk->data + u->pos - sizeof(long));
+  return undo_rec_at(u->chunk, u->pos);
+}
+
+// the undone record after the journal position, moving the position past
+// it; NULL if there is nothing to redo
+static struct UndoRec *undo_next(struct Undo *u) {
+  while (u->chunk != NULL && u->pos == u->chunk->used && u->chunk->next != NULL) {
+    u->chunk = u->chunk->next;
+    u->pos = 0;
+  }
+  if (u->chunk == NULL || u->pos == u->chunk->used) {
+    return NULL;
+  }
+
+  struct UndoRec *rec = undo_rec_at(u->chunk, u->pos);
+  u->pos += undo_rec_size(rec->len);
+  return rec;
+}
+
+static void undo_free_chunks(struct Undo *u, struct UndoChunk *chunk) {
+  while (chunk != NULL) {
+    struct UndoChunk *next = chunk->next;
+    u->bytes -= chunk->size;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+void undo_reset(struct Undo *u) {
+  undo_free_chunks(u, u->first);
+  memset(u, 0, sizeof(struct Undo));
+}
+
+// records an edit of len chars at line, col and returns where its text
+// goes. Typing and deleting runs join the group of the edit before them
+// until undo_close(); inserted text right after the last insert is
+// appended to its record
+static char *undo_push(struct Undo *u, int type, unsigned long line,
+                       unsigned long col, unsigned long len) {
+  // whatever was undone can't be redone after a new edit
+  if (u->chunk != NULL) {
+    undo_free_chunks(u, u->chunk->next);
+    u->chunk->next = NULL;
+    u->chunk->used = u->pos;
+    u->last = u->chunk;
+  }
+
+  struct UndoChunk *chunk = u->chunk;
+  unsigned long start = u->pos;
+  struct UndoRec *top = undo_prev(u);
+  int top_here = u->chunk == chunk; // the top record can grow in place
+  u->chunk = chunk;
+  u->pos = start;
+
+  if (top != NULL && u->open && (top->type == type || u->batch)) {
+    if (type == UNDO_INSERT && top->type == type && top_here && top->line == line && top->col + top->len == col &&
+        (char *) top - (char *) chunk->data + undo_rec_size(top->len + len) <= chunk->size) {
+      char *text = (char *) (top + 1) + top->len;
+      unsigned long off = (char *) top - (char *) chunk->data;
+
+      top->len += len;
+      chunk->used = u->pos = off + undo_rec_size(top->len);
+      *(long *) ((char *) chunk->data + u->pos - sizeof(long)) = off;
+      return text;
+    }
+  } else {
+    u->group++;
+  }
+  u->open = 1;
+
+  unsigned long size = undo_rec_size(len);
+  if (chunk == NULL || chunk->used + size > chunk->size) {
+    unsigned long csize = MAX(size, (unsigned long) UNDO_CHUNK_SIZE);
+    struct UndoChunk *fresh = malloc(sizeof(struct UndoChunk) + csize);
+    if (fresh == NULL) {
+      fatal_err("can't allocate undo journal");
+    }
+
+    fresh->prev = chunk;
+    fresh->next = NULL;
+    fresh->size = csize;
+    fresh->used = fresh->start = 0;
+    if (chunk != NULL) {
+      chunk->next = fresh;
+    } else {
+      u->first = fresh;
+    }
+    u->last = u->chunk = chunk = fresh;
+    u->bytes += csize;
+  }
+
+  unsigned long off = chunk->used;
+  struct UndoRec *rec = undo_rec_at(chunk, off);
+  rec->line = line;
+  rec->col = col;
+  rec->len = len;
+  rec->group = u->group;
+  rec->type = type;
+  chunk->used = u->pos = off + size;
+  *(long *) ((char *) chunk->data + u->pos - sizeof(long)) = off;
+
+  // the oldest edits go once the journal outgrows its budget, whole
+  // groups at a time: the rest of the group the freed chunk ends in goes
+  // with it, so an undo never stops halfway through a group. The group
+  // being recorded is kept whole even if that overruns the budget
+  while (u->bytes > UNDO_MAX_BYTES && u->first != u->chunk) {
+    struct UndoChunk *old = u->first, *next = old->next;
+    unsigned long last = *(long *) ((char *) old->data + old->used - sizeof(long));
+    unsigned long cut = undo_rec_at(old, last)->group;
+
+    if (cut == u->group) {
+      break;
+    }
+    while (next->start < next->used && undo_rec_at(next, next->start)->group == cut) {
+      next->start += undo_rec_size(undo_rec_at(next, next->start)->len);
+    }
+
+    u->first = next;
+    next->prev = NULL;
+    u->bytes -= old->size;
+    free(old);
+  }
+
+  return (char *) (rec + 1);
+}
+
+// makes the next edit start a group of its own
+void undo_close(struct Undo *u) {
+  u->open = 0;
+}
+
+// inserts text at line r, column col, recording it for undo
+void edit_insert(struct Buffer *buf, unsigned long r, unsigned long col,
+                 const char *s, unsigned long n,
+                 unsigned long *end_r, unsigned long *end_c) {
+  memcpy(undo_push(&buf->undo, UNDO_INSERT, r, col, n), s, n);
+  buffer_insert(buf, r, col, s, n, end_r, end_c);
+
+  // a new line ends the typing run
+  if (memchr(s, '\n', n) != NULL) {
+    undo_close(&buf->undo);
+  }
+}
+
+// deletes text at line r, column col, recording it for undo
+void edit_delete(struct Buffer *buf, unsigned long r, unsigned long col, unsigned long n) {
+  buffer_copy(buf, r, col, n, undo_push(&buf->undo, UNDO_DELETE, r, col, n));
+  buffer_delete(buf, r, col, n);
+}
+
+// sets the indent of rows first to last from their leading spaces, as
+// an undo or redo puts back text without the tab presses that made it
+static void line_tabs_reset(struct Buffer *buf, unsigned long first, unsigned long last) {
+  for (unsigned long i = first; i <= last; ++i) {
+    struct Line *line = buffer_line(buf, i);
+    struct RowText t = row_text(&line->row);
+    unsigned long len = t.alen + t.blen, n = 0;
+
+    while (n < len && rt_at(&t, n) == ' ') {
+      n++;
+    }
+    line->tabs = n / TAB_SIZE;
+  }
+}
+
+// undoes the last group of edits, leaving the cursor where it was;
+// returns whether there was anything to undo
+int buffer_undo(struct Buffer *buf) {
+  struct Undo *u = &buf->undo;
+  struct UndoRec *rec = undo_prev(u);
+  unsigned long r, c;
+
+  if (rec == NULL) {
+    return 0;
+  }
+
+  unsigned long group = rec->group;
+  while (rec != NULL && rec->group == group) {
+    if (rec->type == UNDO_INSERT) {
+      buffer_delete(buf, rec->line, rec->col, rec->len);
+      r = rec->line;
+      c = rec->col;
+    } else {
+      buffer_insert(buf, rec->line, rec->col, (char *) (rec + 1), rec->len, &r, &c);
+    }
+    line_tabs_reset(buf, rec->line, r);
+
+    rec = undo_prev(u);
+  }
+
+  // that one belongs to an earlier group, step back over it
+  if (rec != NULL) {
+    undo_next(u);
+  }
+
+  buf->cx = r;
+  buf->cy = c;
+  undo_close(u);
+  return 1;
+}
+
+// redoes the group of edits undone last; returns whether there was one
+int buffer_redo(struct Buffer *buf) {
+  struct Undo *u = &buf->undo;
+  struct UndoRec *rec = undo_next(u);
+  unsigned long r, c;
+
+  if (rec == NULL) {
+    return 0;
+  }
+
+  unsigned long group = rec->group;
+  while (rec != NULL && rec->group == group) {
+    if (rec->type == UNDO_INSERT) {
+      buffer_insert(buf, rec->line, rec->col, (char *) (rec + 1), rec->len, &r, &c);
+    } else {
+      buffer_delete(buf, rec->line, rec->col, rec->len);
+      r = rec->line;
+      c = rec->col;
+    }
+    line_tabs_reset(buf, rec->line, r);
+
+    struct UndoChunk *chunk = u->chunk;
+    unsigned long pos = u->pos;
+    rec = undo_next(u);
+    if (rec != NULL && rec->group != group) {
+      u->chunk = chunk;
+      u->pos = pos;
+    }
+  }
+
+  buf->cx = r;
+  buf->cy = c;
+  undo_close(u);
+  return 1;
+}
+
+// what a regex replace found in one row: its chars [start, end) become
+// the len chars at off in the chunk's text
+struct ReplaceHit {
+  unsigned long line;
+  unsigned long start, end;
+  unsigned long off, len;
+};
+
+// the rows a replace changes in a run of REPLACE_CHUNK lines, in order
+struct ReplaceChunk {
+  struct ReplaceHit *hits;
+  unsigned long nhits, hits_cap;
+  char *text;
+  unsigned long len, cap;
+  unsigned long matches;
+};
+
+// a regex replace over the whole buffer. Workers take the rows a chunk
+// at a time and only read the buffer; the changes are applied after
+struct Replace {
+  struct Buffer *buf;
+  const char *with;
+  unsigned long nchunks;
+  atomic_ulong next; // the next chunk nobody took yet
+  struct ReplaceChunk *chunks;
+};
+
+// every worker runs its own copy of the pattern, as glibc serializes
+// regexec() calls on a shared one
+struct ReplaceWorker {
+  struct Replace *job;
+  regex_t re;
+  pthread_t thread;
+  int running;
+};
+
+static void replace_append(struct ReplaceChunk *c, const char *s, unsigned long n) {
+  if (c->len + n > c->cap) {
+    c->cap = MAX(c->cap * 2, c->len + n + 256);
+    c->text = realloc(c->text, c->cap);
+    if (c->text == NULL) {
+      fatal_err("can't allocate replace text");
+    }
+  }
+  memcpy(c->text + c->len, s, n);
+  c->len += n;
+}
+
+// appends the replacement for the match pm in s: & or \0 stand for the
+// whole match, \1 to \9 for its groups and a backslash quotes what follows
+static void replace_expand(struct ReplaceChunk *c, const char *with, const char *s,
+                           const regmatch_t *pm, size_t npm) {
+  for (const char *p = with; *p != 0; ++p) {
+    size_t k = 10;
+
+    if (*p == '&') {
+      k = 0;
+    } else if (*p == '\\' && p[1] >= '0' && p[1] <= '9') {
+      k = *++p - '0';
+    } else if (*p == '\\' && p[1] != 0) {
+      ++p;
+    }
+
+    if (k == 10) {
+      replace_append(c, p, 1);
+    } else if (k < npm && pm[k].rm_so >= 0) {
+      replace_append(c, s + pm[k].rm_so, pm[k].rm_eo - pm[k].rm_so);
+    }
+  }
+}
+
+// finds and expands the matches in the rows of chunk k
+static void replace_chunk(struct Replace *job, const regex_t *re, unsigned long k) {
+  struct ReplaceChunk *c = &job->chunks[k];
+  size_t npm = MIN(re->re_nsub + 1, (size_t) 10);
+  regmatch_t pm[10];
+  unsigned long first = k * REPLACE_CHUNK;
+  unsigned long last = MIN(first + REPLACE_CHUNK, job->buf->size);
+  struct LineIter it;
+  struct Line *line = line_iter_start(job->buf, first, &it);
+
+  for (unsigned long i = first; i < last; ++i, line = line_iter_next(&it)) {
+    struct RowText t = row_text(&line->row);
+    const char *s = t.alen > 0 ? t.a : t.blen > 0 ? t.b : "";
+    unsigned long len = t.alen + t.blen;
+    unsigned long off = 0, done = 0, start = 0, text_off = c->len;
+    int found = 0;
+
+    // rows aren't nul terminated, REG_STARTEND bounds the match instead
+    for (pm[0].rm_so = 0, pm[0].rm_eo = len;
+         off <= len && regexec(re, s, npm, pm, REG_STARTEND) == 0;
+         pm[0].rm_so = off, pm[0].rm_eo = len) {
+      if (!found) {
+        found = 1;
+        start = done = pm[0].rm_so;
+      }
+      replace_append(c, s + done, pm[0].rm_so - done);
+      replace_expand(c, job->with, s, pm, npm);
+      done = pm[0].rm_eo;
+      c->matches++;
+
+      // after an empty match the next one is looked for a char on
+      off = pm[0].rm_eo > pm[0].rm_so ? pm[0].rm_eo : pm[0].rm_eo + 1;
+    }
+
+    if (!found) {
+      continue;
+    }
+    if (c->nhits == c->hits_cap) {
+      c->hits_cap = MAX(c->hits_cap * 2, 64UL);
+      c->hits = realloc(c->hits, c->hits_cap * sizeof(struct ReplaceHit));
+      if (c->hits == NULL) {
+        fatal_err("can't allocate replace hits");
+      }
+    }
+    c->hits[c->nhits++] = (struct ReplaceHit) { i, start, done, text_off, c->len - text_off };
+  }
+}
+
+static void *replace_worker(void *arg) {
+  struct ReplaceWorker *w = arg;
+  unsigned long k;
+
+  while ((k = atomic_fetch_add(&w->job->next, 1)) < w->job->nchunks) {
+    replace_chunk(w->job, &w->re, k);
+  }
+  return NULL;
+}
+
+// replaces every match of the extended regex pattern with with, finding
+// them on jobs threads and then rebuilding each changed row once, all as
+// one undo step. Returns how many matches there were, or -1 with the
+// reason in err if the pattern doesn't compile
+long buffer_replace(struct Buffer *buf, const char *pattern, const char *with, int jobs,
+                    char *err, size_t errlen) {
+  struct ReplaceWorker *w = calloc(jobs, sizeof(struct ReplaceWorker));
+  struct Replace job = { .buf = buf, .with = with };
+  long matches = 0;
+
+  if (w == NULL) {
+    fatal_err("can't allocate replace workers");
+  }
+
+  int rc = regcomp(&w[0].re, pattern, REG_EXTENDED);
+  if (rc != 0) {
+    regerror(rc, &w[0].re, err, errlen);
+    free(w);
+    return -1;
+  }
+
+  // the workers want each row in one piece
+  buffer_index(buf, ULONG_MAX);
+  struct LineIter it;
+  for (struct Line *line = line_iter_start(buf, 0, &it); line != NULL; line = line_iter_next(&it)) {
+    if (line->row.gap > 0 && line->row.gap_end < line->row.cap) {
+      row_move_gap(&line->row, row_len(&line->row));
+    }
+  }
+
+  job.nchunks = (buf->size + REPLACE_CHUNK - 1) / REPLACE_CHUNK;
+  job.chunks = calloc(job.nchunks, sizeof(struct ReplaceChunk));
+  if (job.chunks == NULL) {
+    fatal_err("can't allocate replace chunks");
+  }
+  atomic_init(&job.next, 0);
+
+  for (int k = 0; k < jobs; ++k) {
+    w[k].job = &job;
+    if (k == 0 || regcomp(&w[k].re, pattern, REG_EXTENDED) != 0) {
+      continue;
+    }
+    w[k].running = pthread_create(&w[k].thread, NULL, replace_worker, &w[k]) == 0;
+    if (!w[k].running) {
+      regfree(&w[k].re);
+    }
+  }
+  replace_worker(&w[0]);
+  regfree(&w[0].re);
+  for (int k = 1; k < jobs; ++k) {
+    if (w[k].running) {
+      pthread_join(w[k].thread, NULL);
+      regfree(&w[k].re);
+    }
+  }
+
+  undo_close(&buf->undo);
+  buf->undo.batch = 1;
+  for (unsigned long k = 0; k < job.nchunks; ++k) {
+    struct ReplaceChunk *c = &job.chunks[k];
+
+    for (unsigned long h = 0; h < c->nhits; ++h) {
+      struct ReplaceHit *hit = &c->hits[h];
+      unsigned long n = hit->end - hit->start;
+
+      if (n > 0) {
+        buffer_copy(buf, hit->line, hit->start, n,
+                    undo_push(&buf->undo, UNDO_DELETE, hit->line, hit->start, n));
+      }
+      if (hit->len > 0) {
+        memcpy(undo_push(&buf->undo, UNDO_INSERT, hit->line, hit->start, hit->len),
+               c->text + hit->off, hit->len);
+      }
+      if (n > 0 || hit->len > 0) {
+        journal_edit(hit->line, hit->start, n, c->text + hit->off, hit->len);
+        line_replace_text(buf, hit->line, hit->start, n, c->text + hit->off, hit->len);
+      }
+    }
+
+    matches += c->matches;
+    free(c->hits);
+    free(c->text);
+  }
+  buf->undo.batch = 0;
+  undo_close(&buf->undo);
+
+  free(job.chunks);
+  free(w);
+  return matches;
+}
+
+void Buffer_dealocate(struct Buffer *buf) {
+  if (buf->tree != NULL) {
+    lines_free(buf->tree);
+    buf->tree = NULL;
+  }
+
+  if (buf->map != NULL) {
+    munmap((void *) buf->map, buf->map_len);
+    buf->map = NULL;
+  }
+
+  undo_reset(&buf->undo);
+  buf->size = 0;
+
+  if (buf != NULL) {
+    free(buf);
+    buf = NULL;
+  }
+}
+
+void buffer_init(struct Buffer* buf) {
+  buf->size = 0;
+  buf->hl_upto = 0;
+  buf->hl_dirty_max = 0;
+  buf->tree = node_new(1);
+  buffer_insert_line(buf, 0);
+  memset(&buf->undo, 0, sizeof(struct Undo));
+  buf->filename[0] = 0;
+
+  buf->top = buf->left = 0;
+  buf->wrap = buf->top_sub = 0;
+  buf->wrap_cols = 0;
+  buf->map = NULL;
+  buf->map_len = buf->map_next = 0;
+  buf->indexed = 1;
+  buf->crlf = 0;
+
+  buf->hl_upto = 0;
+  buf->hl_dirty_max = 0;
+}
+
+void buffer_write(struct Buffer* buf, char c) {
+
+  char ret_code = 13;
+  char nl = '\n';
+  struct Line *line = buffer_line(buf, buf->cx);
+
+  unsigned long r, col;
+
+  if (c == ret_code || c == nl) {
+    char tabstr[TAB_SIZE * 300 + 1];
+    int tabs = line->tabs;
+    unsigned long indent = TAB_SIZE * MIN(tabs, 300);
+    tabstr[0] = '\n';
+    memset(tabstr + 1, ' ', indent);
+
+    // the new row gets the indentation and whatever was after the cursor
+    edit_insert(buf, buf->cx, buf->cy, tabstr, indent + 1, &r, &col);
+    buffer_line(buf, r)->tabs = tabs;
+
+    buf->cx = r;
+    buf->cy = col;
+  } 
+
+
+  else if (c == 127) { // backspace
+    if (buf->cy <= 0) {
+      return;
+    }
+
+    // right after the indentation a backspace takes a whole tab back
+    unsigned long indent = TAB_SIZE * MIN(line->tabs, 300);
+    struct RowText t = row_text(&line->row);
+    unsigned long spaces = 0;
+    while (spaces < indent && rt_at(&t, spaces) == ' ') {
+      spaces++;
+    }
+
+    if (line->tabs > 0 && spaces == indent && buf->cy == indent) {
+      line->tabs--;
+      buf->cy -= TAB_SIZE;
+      edit_delete(buf, buf->cx, buf->cy, TAB_SIZE);
+      return;
+    }
+
+    // a whole cluster, a char with the marks on it
+    unsigned long prev = line_prev(line, buf->cy);
+    edit_delete(buf, buf->cx, prev, buf->cy - prev);
+    buf->cy = prev;
+  } 
+
+  else if (c == '\t') { // convert tabs to spaces
+    char tabstr[TAB_SIZE];
+    memset(tabstr, ' ', TAB_SIZE);
+
+    line->tabs++;
+    edit_insert(buf, buf->cx, buf->cy, tabstr, TAB_SIZE, &r, &col);
+    buf->cy = col;
+  }
+  else { //writable chars
+    edit_insert(buf, buf->cx, buf->cy, &c, 1, &r, &col);
+    buf->cy = col;
+  }
+}
+
+// the display column of the cursor
+unsigned long cursor_col(struct Buffer *buf) {
+  return line_col(buffer_line(buf, buf->cx), buf->cy);
+}
+
+// puts the cursor on the cluster at display column col of its line, or
+// at the end of a shorter one
+static void cursor_to_col(struct Buffer *buf, unsigned long col) {
+  buf->cy = line_byte(buffer_line(buf, buf->cx), col);
+}
+
+// lines wrap and have been drawn wrapped, so moves go by screen line
+static int wrapping(struct Buffer *buf) {
+  return buf->wrap && buf->wrap_cols > 0;
+}
+
+// moves the cursor n screen lines up or down, keeping its column within
+// the screen line
+static void wrap_move(struct Buffer *buf, int dir, unsigned long n) {
+  unsigned int width = buf->wrap_cols;
+  struct Line *line = buffer_line(buf, buf->cx);
+  unsigned long row = buf->cx;
+  int sub = wrap_find(line, width, buf->cy);
+  unsigned long col = wrap_col(line, width, sub, buf->cy);
+
+  for (; n > 0; --n) {
+    if (!wrap_step(buf, &row, &sub, dir)) {
+      break;
+    }
+  }
+  buf->cx = row;
+  buf->cy = wrap_byte(buffer_line(buf, row), width, sub, col);
+}
+
+// moves the cursor to line n, counted from 1, putting it mid screen
+void goto_line(struct Buffer *buf, struct Screen *scr, unsigned long n) {
+  unsigned long half = screen_text_lins(scr) / 2;
+  unsigned long col = cursor_col(buf);
+
+  buffer_index(buf, n);
+  buf->cx = MIN(MAX(n, 1UL), buf->size) - 1;
+  cursor_to_col(buf, col);
+  buf->top = buf->cx > half ? buf->cx - half : 0;
+  buf->top_sub = 0;
+}
+
+void move_up(struct Buffer *buf) {
+  if (wrapping(buf)) {
+    wrap_move(buf, -1, 1);
+  } else if (buf->cx > 0) {
+    unsigned long col = cursor_col(buf);
+    buf->cx--;
+    cursor_to_col(buf, col);
+  }
+}
+
+void move_down(struct Buffer *buf) {
+  if (wrapping(buf)) {
+    wrap_move(buf, 1, 1);
+    return;
+  }
+  buffer_index(buf, buf->cx + 2);
+  if (buf->cx < buf->size - 1) {
+    unsigned long col = cursor_col(buf);
+    buf->cx++;
+    cursor_to_col(buf, col);
+  }
+}
+
+void move_left(struct Buffer *buf) {
+  buf->cy = line_prev(buffer_line(buf, buf->cx), buf->cy);
+}
+
+void move_right(struct Buffer *buf) {
+  buf->cy = line_next(buffer_line(buf, buf->cx), buf->cy);
+}
+
+// the view moves a page and the cursor with it
+void move_page(struct Buffer *buf, struct Screen *scr, int dir) {
+  unsigned long page = screen_text_lins(scr);
+
+  if (wrapping(buf)) {
+    unsigned long row = buf->top;
+    int sub = buf->top_sub;
+    for (unsigned long k = 0; k < page; ++k) {
+      if (!wrap_step(buf, &row, &sub, dir)) {
+        break;
+      }
+    }
+    buf->top = row;
+    buf->top_sub = sub;
+    wrap_move(buf, dir, page);
+    return;
+  }
+
+  unsigned long col = cursor_col(buf);
+
+  if (dir < 0) {
+    buf->cx = buf->cx > page ? buf->cx - page : 0;
+    buf->top = buf->top > page ? buf->top - page : 0;
+  } else {
+    buffer_index(buf, buf->cx + page + 1);
+    buf->cx = MIN(buf->cx + page, buf->size - 1);
+    buf->top = MIN(buf->top + page, (unsigned long) buf->cx);
+  }
+  cursor_to_col(buf, col);
+}
+
+// writes out the batched spans, picking up after short writes
+static void save_flush(struct SaveBatch *b) {
+  struct iovec *iov = b->iov;
+  int n = b->n;
+
+  while (n > 0 && !b->err) {
+    ssize_t w = writev(b->fd, iov, n);
+    if (w < 0) {
+      b->err = errno != EINTR;
+      continue;
+    }
+
+    b->bytes += w;
+    for (; n > 0 && (size_t) w >= iov->iov_len; ++iov, --n) {
+      w -= iov->iov_len;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  b->n = 0;
+}
+
+static void save_add(struct SaveBatch *b, const char *s, unsigned long n) {
+  if (n == 0) {
+    return;
+  }
+  if (b->n == SAVE_IOV_MAX) {
+    save_flush(b);
+  }
+  b->iov[b->n].iov_base = (void *) s;
+  b->iov[b->n].iov_len = n;
+  b->n++;
+}
+
+// writes the text of buf to fd; returns -1 on a write error
+int save_write(int fd, struct Buffer *buf, unsigned long *bytes) {
+  struct SaveBatch *b = malloc(sizeof(struct SaveBatch));
+  if (b == NULL) {
+    fatal_err("can't allocate save batch");
+  }
+  b->fd = fd;
+  b->n = 0;
+  b->bytes = 0;
+  b->err = 0;
+
+  const char *eol = buf->crlf ? "\r\n" : "\n";
+  unsigned long eol_len = strlen(eol);
+  struct LineIter it;
+  struct Line *line = line_iter_start(buf, 0, &it);
+
+  for (int i = 0; line != NULL && !b->err; ++i, line = line_iter_next(&it)) {
+    if (i > 0) {
+      save_add(b, eol, eol_len);
+    }
+
+    struct RowText t = row_text(&line->row);
+    save_add(b, t.a, t.alen);
+    save_add(b, t.b, t.blen);
+  }
+
+  // the lines never indexed go out straight from the mapping, a chunk at
+  // a time, dropping the pages written so a save doesn't leave the whole
+  // file resident
+  if (!buf->indexed) {
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    save_add(b, eol, eol_len);
+
+    for (unsigned long off = buf->map_next; off < buf->map_len && !b->err; off += SAVE_CHUNK) {
+      unsigned long n = MIN((unsigned long) SAVE_CHUNK, buf->map_len - off);
+      unsigned long from = off & ~(page - 1);
+
+      save_add(b, buf->map + off, n);
+      save_flush(b);
+      madvise((char *) buf->map + from, off + n - from, MADV_DONTNEED);
+    }
+  }
+  save_flush(b);
+
+  int err = b->err;
+  *bytes = b->bytes;
+  free(b);
+  return err ? -1 : 0;
+}
+
+// writes buf to filename, the number of bytes to *bytes; returns -1
+// with errno set if it couldn't
+int save_file(const char* filename, struct Buffer* buf, unsigned long *bytes) {
+  // write a temporary file next to the target and rename it over the
+  // target once it is on disk, so a failed save leaves the old file whole.
+  // The old file may also still be mapped with rows pointing into it
+  char tmpname[strlen(filename) + 8];
+  sprintf(tmpname, "%s.XXXXXX", filename);
+
+  int fd = mkstemp(tmpname);
+  if (fd < 0) {
+    return -1;
+  }
+  STAT_BEGIN(STAT_SAVE);
+
+  struct stat st;
+  if (stat(filename, &st) == 0) {
+    fchmod(fd, st.st_mode & 07777);
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+  }
+
+  int err = save_write(fd, buf, bytes) < 0 || fsync(fd) < 0;
+
+  if (close(fd) < 0 || err || rename(tmpname, filename) < 0) {
+    int saved_errno = errno;
+    unlink(tmpname);
+    errno = saved_errno;
+    return -1;
+  }
+  fsync_dir(filename);
+
+  // the saved file is the new base the journal starts over from
+  journal_reset(buf);
+  STAT_END(STAT_SAVE);
+  return 0;
+}
+
+void buffer_read(struct Buffer* buf, const char * filename) {
+  STAT_BEGIN(STAT_READ);
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "Unable to open file %s\n", filename);
+    exit(1);
+  }
+
+  lines_free(buf->tree);
+  buf->tree = node_new(1);
+  buf->size = 0;
+  buf->hl_upto = 0;
+  buf->hl_dirty_max = -1;
+  undo_reset(&buf->undo);
+
+  buf->map = NULL;
+  buf->map_len = st.st_size;
+  buf->map_next = 0;
+  buf->indexed = st.st_size == 0;
+  buf->crlf = 0;
+
+  if (st.st_size > 0) {
+    buf->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf->map == MAP_FAILED) {
+      fatal_err("can't map file");
+    }
+  } else {
+    buffer_insert_line(buf, 0);
+  }
+  close(fd);
+
+  // a file whose first line ends in \r\n gets all its newlines written
+  // back that way
+  unsigned long nl;
+  if (buf->map != NULL && newline_scan(buf->map, MIN(buf->map_len, (unsigned long) INDEX_BLOCK), &nl, 1) == 1) {
+    buf->crlf = nl > 0 && buf->map[nl - 1] == '\r';
+  }
+
+  // the rest is split into lines as it gets shown
+  buffer_index(buf, 1);
+  STAT_END(STAT_READ);
+}
@@ -0,0 +1,564 @@
+// the editor core: the buffer model, the highlighter, the key decoder
+// and the frame writer, built as a library the terminal front end in
+// main.c, the benchmarks and the tests link against
+#ifndef EDITOR_H
+#define EDITOR_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifndef STATS
+#define STATS 1 // the timers and counters, see struct Stats
+#endif
+#ifndef STATS_WRAP
+#define STATS_WRAP 0 // linked with -Wl,--wrap for the alloc and write counters
+#endif
+#define TAB_SIZE 2
+#define TAB_STOP 8 // a tab in the text reaches the next multiple of this column
+#define COL_STEP 256 // bytes between the marks of a row's column index
+#define CELL_BYTES 15 // utf-8 a screen cell holds: a char with a few marks, a flag
+#define ANSI_RESET_COLOR "\033[0m"
+#define LINE_LEAF_MAX 32
+#define LINE_NODE_MAX 32
+#define JOURNAL_CHECK_MS 1000
+#define SAVE_CHUNK (1 << 20)
+#define INPUT_RING_SIZE 4096
+#define KEY_MAX_SEQ 32
+
+#define MAX(a, b) \
+  ({ __typeof__(a) a_ = (a); \
+     __typeof__(b) b_ = (b); \
+     a_ > b_ ? a_ : b_; })
+
+#define MIN(a, b) \
+  ({ __typeof__(a) a_ = (a); \
+     __typeof__(b) b_ = (b); \
+     a_ < b_ ? a_ : b_; })
+
+enum highlight {
+  HL_NORMAL,
+  HL_KEYWORD,
+  HL_DATA_TYPE,
+  HL_OPERAND,
+  HL_LINE_NUMBER,
+  HL_COMMENT,
+  HL_STRING,
+  HL_MATCH // a search match, drawn on a colored background
+};
+
+// keys the input decoder produces. Codes below 128 are the ascii byte
+// typed, control keys included
+enum key_code {
+  K_TEXT = 128, // a non ascii utf-8 char, its bytes in key.text
+  K_UP,
+  K_DOWN,
+  K_RIGHT,
+  K_LEFT,
+  K_HOME,
+  K_END,
+  K_PGUP,
+  K_PGDN,
+  K_INSERT,
+  K_DELETE,
+  K_PASTE, // the start of a bracketed paste, read it with input_read_paste
+  K_UNKNOWN, // a sequence the decoder skipped
+  K_COUNT
+};
+
+#define K_MOD_SHIFT 1
+#define K_MOD_ALT 2
+#define K_MOD_CTRL 4
+
+struct Key {
+  int code;
+  int mods;
+  char text[4]; // the bytes of a K_TEXT char
+  int len;
+};
+
+// bytes read from the tty and not decoded yet
+struct Input {
+  unsigned char ring[INPUT_RING_SIZE];
+  unsigned long head; // next byte to decode
+  unsigned long tail; // where the next read goes
+  int fd;             // the tty, or a script being replayed
+  int eof;            // fd has nothing more
+  int record;         // what is read is copied here unless -1
+};
+
+// everything sent to the terminal during a frame is appended here and
+// flushed with a single write() at the end of the frame
+struct Frame {
+  char *data;
+  size_t len;
+  size_t cap;
+  int color; // highlight currently in effect on the terminal, -1 if unknown
+
+  unsigned long frames;
+  unsigned long writes; // write() calls for the last frame
+  unsigned long bytes;  // bytes for the last frame
+  unsigned long total_writes;
+  unsigned long total_bytes;
+};
+
+// a highlighted run of a row
+struct HlSpan {
+  unsigned long start;
+  unsigned long len;
+  unsigned char hl;
+};
+
+// highlighting of a row, kept until the row is edited
+struct HlCache {
+  struct HlSpan *spans;
+  int nspans;
+  int cap;
+  unsigned char start_state; // lexer state the row was lexed from
+  unsigned char end_state;
+  unsigned char valid;
+};
+
+// a row's text is kept in a gap buffer, data[0..gap) and
+// data[gap_end..cap), so typing at the cursor only fills the gap
+// a row read from a file starts out pointing into the file mapping and is
+// only copied into a buffer of its own the first time it is edited
+struct Row {
+  char *data;
+  unsigned long gap;
+  unsigned long gap_end;
+  unsigned long cap;
+  int mapped; // data is in the file mapping and not ours to change
+};
+
+struct RowText {
+  const char *a;
+  unsigned long alen;
+  const char *b;
+  unsigned long blen;
+};
+
+// display columns at points about COL_STEP bytes apart in a long row, so
+// the column of a byte or the byte at a column is found by a binary search
+// and a short scan. Each mark starts a grapheme cluster; the marks only
+// go as far as the row has been looked at
+struct ColMark {
+  unsigned long pos;
+  unsigned long col;
+  int after_tab; // a tab lies between the mark before and this one
+};
+
+struct ColIndex {
+  int n;
+  int cap;
+  int done; // the marks reach the end of the row
+  struct ColMark mark[];
+};
+
+// where a row breaks into screen lines in wrap mode: brk[k] is the byte
+// the screen line after the k-th starts at. Breaks are worked out as far
+// as the screen needs them, for one width at a time
+struct Wrap {
+  unsigned int width;
+  int n;
+  int cap;
+  int done; // the breaks reach the end of the row
+  unsigned long brk[];
+};
+
+struct Line {
+  struct Row row;
+  int tabs;
+  struct HlCache hl;
+  struct ColIndex *cols; // NULL until a row of COL_STEP bytes or more is looked up
+  struct Wrap *wrap;     // NULL until the row is drawn wrapped
+};
+
+// the lines are kept in a B+ tree so finding, inserting or deleting one is
+// O(log n). Each node counts the lines and bytes (newlines included) under
+// it; leaves are linked for walking consecutive lines. Nodes hold one
+// entry more than their maximum while they are being split
+struct LineNode {
+  struct LineNode *parent;
+  unsigned long nlines;
+  unsigned long nbytes;
+  int n;
+  int leaf;
+  struct LineNode *prev, *next; // neighbouring leaves
+  union {
+    struct LineNode *child[LINE_NODE_MAX + 1];
+    struct Line line[LINE_LEAF_MAX + 1];
+  };
+};
+
+struct LineIter {
+  struct LineNode *leaf;
+  int idx;
+};
+
+struct UndoChunk;
+
+struct Undo {
+  struct UndoChunk *first, *last;
+  struct UndoChunk *chunk; // records before pos in chunk are applied,
+  unsigned long pos;       // the ones after can be redone
+  unsigned long bytes;     // in all chunks
+  unsigned long group;
+  int open;                // the next edit of the same type joins the group
+  int batch;               // while set, every edit joins the open group
+};
+
+struct Buffer {
+  unsigned long size;
+  struct LineNode *tree;
+  int cx, cy; // cursor line and byte in it
+  unsigned long top;  // first line on screen
+  unsigned long left; // first display column on screen
+  int wrap;              // long lines wrap instead of scrolling sideways
+  int top_sub;           // in wrap mode, the screen line of top shown first
+  unsigned int wrap_cols; // the width lines were last wrapped at, 0 before
+  const char *map;   // the file read, mapped read only
+  unsigned long map_len;
+  unsigned long map_next; // where the lines not split off yet start
+  int indexed;            // every line of the mapping is in the tree
+  int crlf;               // lines end in \r\n, stripped and put back on save
+  char filename[300];
+  unsigned long hl_upto; // rows before this have consistent highlighting
+  long hl_dirty_max;     // last row invalidated since then
+  struct Undo undo;
+};
+
+// a column of the screen: the utf-8 of the cluster drawn there, nul
+// padded, or no bytes at all for the right half of a wide one
+struct Cell {
+  char ch[CELL_BYTES];
+  unsigned char hl;
+};
+
+struct Screen {
+  unsigned int lins;
+  unsigned int cols;
+  struct Cell *front; // what the terminal is showing
+  struct Cell *back;  // the frame being composed
+  int redraw;         // the terminal no longer matches front
+  int scroll;         // lines the text moved up since the last frame, a hint
+  unsigned int scroll_lins; // the top lines that scroll, the rest stay put
+  char *csr;         // terminfo scroll capabilities, NULL if missing
+  char *indn, *rin;  // scroll n lines, or else
+  char *ind, *ri;    // scroll one line from the region's bottom / top
+  unsigned long drawn_top; // the first text line of the last frame shown
+};
+
+// a composed frame handed from the editing thread to the render thread
+struct Snapshot {
+  unsigned int lins;
+  unsigned int cols;
+  struct Cell *cells;
+  size_t cap;
+  unsigned long top;        // the first text line shown
+  unsigned int text_lins;
+  int cursor_y;
+  int cursor_x;
+};
+
+// three snapshots passed around without locks: the editing thread fills
+// one, the render thread draws another and the third sits in mid. Each
+// side swaps its own for mid, so the renderer always gets the newest
+// frame and frames it had no time for are dropped
+#define SNAP_FRESH 4 // set in mid when it holds a frame not drawn yet
+
+struct Render {
+  int on;
+  pthread_t thread;
+  sem_t wake;           // posted for each frame published and to stop
+  atomic_int stop;
+  struct Snapshot snap[3];
+  int back;             // the editing thread's
+  int front;            // the render thread's
+  atomic_int mid;
+  struct Screen *scr;   // the render thread's own screen
+};
+
+// the start of a journal file, telling what its edits apply to
+struct JournalHead {
+  char magic[8];
+  unsigned sum;              // of the rest of the head
+  int crlf;
+  unsigned long base_size;   // of the file or the snapshot
+  struct timespec base_mtime;
+  unsigned long snapshot;    // the edits apply to snapshot n, to the file if 0
+};
+
+struct JournalStats {
+  unsigned long edits, bytes;
+  unsigned long writes, fsyncs;
+  double write_ms, fsync_ms, fsync_max_ms;
+  double lag_ms, lag_max_ms; // from an edit to its write, per batch
+  unsigned long snapshots;
+  int err;                   // errno of the last failure, 0 once reported
+};
+
+// edits go to a swap journal next to the file so a crash loses nothing
+// since the last save. The editing thread only appends records to
+// pending; a writer thread of its own writes them out, fsyncs at most
+// every JOURNAL_SYNC_MS, and swaps in snapshots taken by a forked child
+struct Journal {
+  int on;
+  int off;              // nothing is journaled, for replays
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  char *pending;        // records the writer didn't take yet
+  unsigned long len, cap;
+  double since;         // when the oldest of them came
+  int stop;
+  struct JournalStats stats;
+
+  // the editing thread's
+  char path[320];
+  unsigned long pos;      // bytes of edits journaled so far
+  unsigned long base_pos; // pos the journal file starts at
+  unsigned long snapshot; // the last snapshot id handed out
+  pid_t child;            // writing snapshot child_id of the edits up
+  unsigned long child_id; // to child_pos, 0 if none
+  unsigned long child_pos;
+  char child_path[344];
+
+  // the writer's
+  int fd;
+  char wpath[320];
+  struct JournalHead head;
+  unsigned long size;      // of the journal file
+  unsigned long wpos;      // stream pos written up to
+  unsigned long file_base; // stream pos the records in the file start at
+  double last_sync;
+  int dirty;               // written since the last fsync
+};
+
+enum stat_timer {
+  STAT_INPUT,     // a key, from dispatch to the buffer changed
+  STAT_EDIT,      // buffer_write
+  STAT_RENDER,    // render_buf, highlighting and flushing inline included
+  STAT_HIGHLIGHT,
+  STAT_FLUSH,     // a frame written to the terminal, on whichever thread
+  STAT_READ,
+  STAT_SAVE,
+  STAT_TIMERS
+};
+
+enum stat_counter {
+  STAT_ALLOCS,      // malloc, calloc and realloc calls
+  STAT_ALLOC_BYTES,
+  STAT_FREES,
+  STAT_WRITES,      // write and writev calls
+  STAT_WRITE_BYTES,
+  STAT_COUNTERS
+};
+
+struct StatTimer {
+  atomic_ulong calls;
+  atomic_ulong ns;
+  atomic_ulong max_ns;
+};
+
+// where the time goes, kept by STAT_BEGIN/STAT_END around the hot paths
+// and STAT_ADD counters. All relaxed atomics, as the render and journal
+// threads write too, and all compiled out with STATS 0. Allocations and
+// writes are counted by the __wrap_ functions the build links in with
+// -Wl,--wrap
+struct Stats {
+  struct StatTimer timer[STAT_TIMERS];
+  atomic_ulong count[STAT_COUNTERS];
+  int overlay;             // shown on the status line
+  char line[160];          // what the overlay shows, redone every STATS_OVERLAY_MS
+  unsigned long last_calls[STAT_TIMERS]; // the totals line was last done from
+  unsigned long last_ns[STAT_TIMERS];
+  unsigned long last_count[STAT_COUNTERS];
+  const char *dump;        // --stats, written as json at exit
+};
+
+#if STATS
+#define STAT_BEGIN(t) unsigned long stat_begin_##t = stat_ns()
+#define STAT_END(t) stat_time(t, stat_begin_##t)
+#define STAT_ADD(c, n) atomic_fetch_add_explicit(&stats.count[c], (n), memory_order_relaxed)
+#else
+#define STAT_BEGIN(t)
+#define STAT_END(t)
+#define STAT_ADD(c, n)
+#endif
+
+extern struct Frame frame;
+extern struct Render render;
+extern struct Journal journal;
+extern struct Stats stats;
+
+static inline unsigned long stat_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline void stat_time(int t, unsigned long begin) {
+  struct StatTimer *st = &stats.timer[t];
+  unsigned long ns = stat_ns() - begin;
+  unsigned long max = atomic_load_explicit(&st->max_ns, memory_order_relaxed);
+
+  atomic_fetch_add_explicit(&st->calls, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&st->ns, ns, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit(&st->max_ns, &max, ns, memory_order_relaxed,
+                                                            memory_order_relaxed)) {
+  }
+}
+
+static inline char rt_at(const struct RowText *t, unsigned long i) {
+  return i < t->alen ? t->a[i] : t->b[i - t->alen];
+}
+
+// util.c
+void fatal_err(char *);
+double now_ms(void);
+int write_full(int fd, const char *s, unsigned long n);
+int fsync_dir(const char *filename);
+
+// buffer.c: rows, the line tree, edits and undo, loading and saving
+unsigned long row_len(const struct Row *row);
+struct RowText row_text(const struct Row *row);
+void rt_copy(const struct RowText *t, unsigned long from, unsigned long n, char *dst);
+void row_insert(struct Row *row, unsigned long pos, const char *s, unsigned long n);
+void row_delete(struct Row *row, unsigned long pos, unsigned long n);
+void row_init(struct Row *row, const char *s, unsigned long n);
+void row_map(struct Row *row, const char *s, unsigned long n);
+void row_free(struct Row *row);
+struct Line *buffer_line(const struct Buffer *buf, unsigned long i);
+struct Line *buffer_insert_line(struct Buffer *buf, unsigned long i);
+void buffer_delete_line(struct Buffer *buf, unsigned long i);
+unsigned long buffer_line_offset(const struct Buffer *buf, unsigned long i);
+void line_insert_text(struct Buffer *buf, unsigned long i, unsigned long pos,
+                      const char *s, unsigned long n);
+void line_delete_text(struct Buffer *buf, unsigned long i, unsigned long pos,
+                      unsigned long n);
+void line_replace_text(struct Buffer *buf, unsigned long i, unsigned long pos, unsigned long n,
+                       const char *s, unsigned long m);
+struct Line *line_iter_start(const struct Buffer *buf, unsigned long i, struct LineIter *it);
+struct Line *line_iter_next(struct LineIter *it);
+struct Line *line_iter_prev(struct LineIter *it);
+extern int (*newline_scan)(const char *, unsigned long, unsigned long *, int);
+void newline_scan_init(void);
+unsigned long newline_count(const char *s, unsigned long n);
+void buffer_index(struct Buffer *buf, unsigned long n);
+void buffer_insert(struct Buffer *buf, unsigned long r, unsigned long col,
+                   const char *s, unsigned long n,
+                   unsigned long *end_r, unsigned long *end_c);
+void buffer_delete(struct Buffer *buf, unsigned long r, unsigned long col, unsigned long n);
+void buffer_copy(struct Buffer *buf, unsigned long r, unsigned long col,
+                 unsigned long n, char *dst);
+void undo_reset(struct Undo *u);
+void undo_close(struct Undo *u);
+void edit_insert(struct Buffer *buf, unsigned long r, unsigned long col,
+                 const char *s, unsigned long n,
+                 unsigned long *end_r, unsigned long *end_c);
+void edit_delete(struct Buffer *buf, unsigned long r, unsigned long col, unsigned long n);
+int buffer_undo(struct Buffer *buf);
+int buffer_redo(struct Buffer *buf);
+long buffer_replace(struct Buffer *buf, const char *pattern, const char *with, int jobs,
+                    char *err, size_t errlen);
+void Buffer_dealocate(struct Buffer *buf);
+void buffer_init(struct Buffer *buf);
+void buffer_write(struct Buffer *buf, char c);
+unsigned long cursor_col(struct Buffer *buf);
+void goto_line(struct Buffer *buf, struct Screen *scr, unsigned long n);
+void move_up(struct Buffer *buf);
+void move_down(struct Buffer *buf);
+void move_left(struct Buffer *buf);
+void move_right(struct Buffer *buf);
+void move_page(struct Buffer *buf, struct Screen *scr, int dir);
+int save_write(int fd, struct Buffer *buf, unsigned long *bytes);
+int save_file(const char *filename, struct Buffer *buf, unsigned long *bytes);
+void buffer_read(struct Buffer *buf, const char *filename);
+
+// search.c
+extern const char *(*text_find)(const char *, unsigned long, const char *, unsigned long);
+void text_find_init(void);
+const char *row_flat(const struct Row *row);
+int buffer_search(struct Buffer *buf, const char *q, unsigned long m, int dir,
+                  unsigned long r, unsigned long col, unsigned long *line, unsigned long *c);
+
+// highlight.c
+void hl_init(void);
+const char *hl_collision(void);
+int is_highlight(const char *word, size_t len);
+int highlight_row(const struct RowText *t, int state,
+                  struct HlSpan *spans, int max, int *end_state);
+void highlight_invalidate(struct Buffer *buf, unsigned long r);
+void highlight_update(struct Buffer *buf, unsigned long first, unsigned long last);
+
+// screen.c: composing frames and writing them to the terminal
+void frame_append(struct Frame *f, const char *s, size_t n);
+void frame_puts(struct Frame *f, const char *s);
+void frame_set_color(struct Frame *f, int highlight);
+void frame_flush(struct Frame *f);
+void screen_resize(struct Screen *scr, unsigned int lins, unsigned int cols);
+void screen_clear(struct Screen *scr);
+unsigned int screen_draw(struct Screen *scr, unsigned int y, unsigned int x,
+                         const char *s, size_t n, int hl);
+int screen_draw_text(struct Screen *scr, unsigned int y, unsigned int x, unsigned long left,
+                     const struct RowText *t, unsigned long *pos, unsigned long to,
+                     unsigned long *col, int hl);
+unsigned int screen_text_lins(const struct Screen *scr);
+void screen_init_caps(struct Screen *scr);
+void screen_flush(struct Screen *scr, struct Frame *f, int cursor_y, int cursor_x);
+void screen_show(struct Screen *scr, unsigned long top, unsigned int text_lins,
+                 int cursor_y, int cursor_x);
+void render_publish(struct Screen *scr, unsigned long top, unsigned int text_lins,
+                    int cursor_y, int cursor_x);
+void render_start(const struct Screen *scr);
+void render_stop(void);
+
+// journal.c
+void journal_path(const char *filename, char *path, size_t n);
+void journal_edit(unsigned long line, unsigned long col, unsigned long del,
+                  const char *s, unsigned long len);
+void journal_reset(struct Buffer *buf);
+int journal_check(struct Buffer *buf);
+void journal_stop(void);
+int journal_exists(const char *filename);
+unsigned long journal_recover(struct Buffer *buf);
+
+// utf8.c: decoding, display widths and the column index of rows
+int utf8_decode(const struct RowText *t, unsigned long i, unsigned long len, unsigned *cp);
+int utf8_encode(unsigned cp, char *s);
+int char_width(unsigned cp);
+unsigned long cluster_next(const struct RowText *t, unsigned long i, unsigned long len,
+                           unsigned long col, int *width);
+unsigned long line_col(struct Line *line, unsigned long pos);
+unsigned long line_byte(struct Line *line, unsigned long col);
+unsigned long line_next(struct Line *line, unsigned long pos);
+unsigned long line_prev(struct Line *line, unsigned long pos);
+void line_cols_edit(struct Line *line, unsigned long pos, unsigned long del, unsigned long ins);
+
+// input.c: reading the tty and decoding keys
+int input_fill(struct Input *in);
+int key_parse(const unsigned char *s, int n, int final, struct Key *key);
+int input_get_key(struct Input *in, struct Key *key, int final);
+char *input_read_paste(struct Input *in, unsigned long *len);
+
+// wrap.c: soft wrapping rows into screen lines
+int wrap_count(struct Line *line, unsigned int width);
+int wrap_has(struct Line *line, unsigned int width, int k);
+int wrap_find(struct Line *line, unsigned int width, unsigned long pos);
+unsigned long wrap_start(struct Line *line, unsigned int width, int k);
+unsigned long wrap_end(struct Line *line, unsigned int width, int k);
+unsigned long wrap_col(struct Line *line, unsigned int width, int k, unsigned long pos);
+unsigned long wrap_byte(struct Line *line, unsigned int width, int k, unsigned long col);
+void line_wrap_edit(struct Line *line, unsigned long pos);
+int wrap_step(struct Buffer *buf, unsigned long *row, int *sub, int dir);
+int wrap_distance(struct Buffer *buf, unsigned long row, int sub,
+                  unsigned long to_row, int to_sub, int max);
+
+// stats.c
+int stats_write(const char *path);
+
+#endif
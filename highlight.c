@@ -0,0 +1,351 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "editor.h"
+
+#define HL_HASH_SIZE 128
+#define HL_MAX_OPERATOR 3
+#define HL_MAX_SPANS 1024
+#define HL_MAX_WORD 16
+#define HL_SYNC_LINES 5000
+
+// what the lexer is in the middle of at the end of a row
+enum lexer_state {
+  HL_STATE_NORMAL,
+  HL_STATE_COMMENT,
+  HL_STATE_STRING
+};
+
+const char *keywords[] = {
+  "while", 
+  "for", 
+  "if", 
+  "else", 
+  "switch",
+  "case",
+  "return"
+};
+
+const char *data_types[] = {
+  "int",
+  "float",
+  "double",
+  "char",
+  "void",
+  "unsigned",
+  "long",
+  "sizeof"
+};
+
+const char *operands[] = {
+  "+",
+  "-",
+  "=",
+  ";",
+  "<",
+  ">",
+  "!",
+  "%",
+  "&",
+  "|",
+  "<<",
+  ">>",
+  "++",
+  "--",
+  "+=",
+  "-=",
+  "/=",
+  "*=",
+  "<=",
+  ">=",
+  "==",
+  "!=",
+  "&&",
+  "||",
+  "<<=",
+  ">>=",
+  "%=",
+  "&=",
+  "|="
+};
+
+struct HlWord {
+  const char *word;
+  unsigned char len;
+  unsigned char hl;
+};
+
+// keywords, data types and operands hashed into their own slot each;
+// tests/highlight_test.c checks hl_hash() keeps them apart
+struct HlWord hl_table[HL_HASH_SIZE];
+unsigned char hl_operator_start[256];
+
+static unsigned hl_hash(const char *word, size_t len) {
+  return (len * 4 + (unsigned char) word[0] * 7 + (unsigned char) word[len - 1] * 20)
+         & (HL_HASH_SIZE - 1);
+}
+
+// a word whose slot is taken keeps its first owner, see hl_collision()
+static void hl_add_words(const char **words, size_t n, int hl) {
+  for (size_t i = 0; i < n; ++i) {
+    struct HlWord *slot = &hl_table[hl_hash(words[i], strlen(words[i]))];
+    if (slot->word == NULL) {
+      slot->word = words[i];
+      slot->len = strlen(words[i]);
+      slot->hl = hl;
+    }
+
+    if (hl == HL_OPERAND) {
+      hl_operator_start[(unsigned char) words[i][0]] = 1;
+    }
+  }
+}
+
+// fills the hash table from the word lists. The hash is perfect for them,
+// so a lookup never has to probe
+void hl_init(void) {
+  hl_add_words(keywords, sizeof(keywords) / sizeof(keywords[0]), HL_KEYWORD);
+  hl_add_words(data_types, sizeof(data_types) / sizeof(data_types[0]), HL_DATA_TYPE);
+  hl_add_words(operands, sizeof(operands) / sizeof(operands[0]), HL_OPERAND);
+}
+
+static const char *hl_find_lost(const char **words, size_t n, int hl) {
+  for (size_t i = 0; i < n; ++i) {
+    if (is_highlight(words[i], strlen(words[i])) != hl) {
+      return words[i];
+    }
+  }
+  return NULL;
+}
+
+// after hl_init(), the first word that lost its slot to another, or NULL
+// if the hash is perfect for the word lists
+const char *hl_collision(void) {
+  const char *w = hl_find_lost(keywords, sizeof(keywords) / sizeof(keywords[0]), HL_KEYWORD);
+  if (w == NULL) {
+    w = hl_find_lost(data_types, sizeof(data_types) / sizeof(data_types[0]), HL_DATA_TYPE);
+  }
+  if (w == NULL) {
+    w = hl_find_lost(operands, sizeof(operands) / sizeof(operands[0]), HL_OPERAND);
+  }
+  return w;
+}
+
+// returns the highlight of the len chars at word, HL_NORMAL if none
+int is_highlight(const char* word, size_t len) {
+  const struct HlWord *w = &hl_table[hl_hash(word, len)];
+
+  if (w->len == len && memcmp(w->word, word, len) == 0) {
+    return w->hl;
+  }
+  return HL_NORMAL;
+}
+
+static int is_ident_char(unsigned char c) {
+  return isalnum(c) || c == '_';
+}
+
+static void hl_push(struct HlSpan *spans, int *n, int max, unsigned long start,
+                    unsigned long len, int hl) {
+  if (*n < max && len > 0) {
+    spans[*n].start = start;
+    spans[*n].len = len;
+    spans[*n].hl = hl;
+  }
+  (*n)++;
+}
+
+static int hl_lookup(const struct RowText *t, unsigned long from, unsigned long n) {
+  char word[HL_MAX_WORD];
+
+  if (n > HL_MAX_WORD) {
+    return HL_NORMAL;
+  }
+  rt_copy(t, from, n, word);
+  return is_highlight(word, n);
+}
+
+// lexes the row text t in one pass starting in lexer state state,
+// storing at most max highlighted spans; returns the number of spans the
+// row has (which may be more than max) and the state at the end of the
+// row in *end_state
+int highlight_row(const struct RowText *t, int state,
+                  struct HlSpan *spans, int max, int *end_state) {
+  unsigned long len = t->alen + t->blen;
+  unsigned long i = 0;
+  int n = 0;
+
+  while (i < len) {
+    unsigned char c = rt_at(t, i);
+    unsigned char next = i + 1 < len ? rt_at(t, i + 1) : 0;
+    unsigned long j = i + 1;
+    int hl = HL_NORMAL;
+
+    if (state == HL_STATE_COMMENT) {
+      while (j < len && !(rt_at(t, j - 1) == '*' && rt_at(t, j) == '/')) {
+        j++;
+      }
+      if (j < len) {
+        j++;
+        state = HL_STATE_NORMAL;
+      }
+      hl = HL_COMMENT;
+    }
+
+    else if (state == HL_STATE_STRING || c == '"' || c == '\'') {
+      char quote = state == HL_STATE_STRING ? '"' : c;
+      if (state == HL_STATE_STRING) {
+        j = i;
+      }
+
+      state = HL_STATE_NORMAL;
+      while (j < len && rt_at(t, j) != quote) {
+        if (rt_at(t, j) == '\\' && ++j == len && quote == '"') {
+          state = HL_STATE_STRING; // continued on the next row
+        }
+        j++;
+      }
+      j = MIN(j + 1, len);
+      hl = HL_STRING;
+    }
+
+    else if (c == '/' && next == '/') {
+      j = len;
+      hl = HL_COMMENT;
+    }
+
+    else if (c == '/' && next == '*') {
+      state = HL_STATE_COMMENT;
+      j = i + 2;
+      hl = HL_COMMENT;
+      // the rest of the comment is lexed as a continuation
+      hl_push(spans, &n, max, i, j - i, hl);
+      i = j;
+      continue;
+    }
+
+    else if (isalpha(c) || c == '_') {
+      while (j < len && is_ident_char(rt_at(t, j))) {
+        j++;
+      }
+      hl = hl_lookup(t, i, j - i);
+    }
+
+    else if (isdigit(c)) {
+      while (j < len && (is_ident_char(rt_at(t, j)) || rt_at(t, j) == '.')) {
+        j++;
+      }
+    }
+
+    else if (hl_operator_start[c]) {
+      // longest match first, so "<<=" doesn't lex as "<<" "="
+      for (unsigned long k = MIN(len - i, (unsigned long) HL_MAX_OPERATOR); k > 0; --k) {
+        if (hl_lookup(t, i, k) == HL_OPERAND) {
+          j = i + k;
+          hl = HL_OPERAND;
+          break;
+        }
+      }
+    }
+
+    if (hl != HL_NORMAL) {
+      // a comment opened on this row continues the span of its "/*"
+      if (hl == HL_COMMENT && n > 0 && n <= max && spans[n - 1].hl == HL_COMMENT &&
+          spans[n - 1].start + spans[n - 1].len == i) {
+        spans[n - 1].len += j - i;
+      } else {
+        hl_push(spans, &n, max, i, j - i, hl);
+      }
+    }
+    i = j;
+  }
+
+  *end_state = state;
+  return n;
+}
+
+// relexes line from start_state and caches its spans
+static void highlight_cache_line(struct Line *line, int start_state) {
+  static struct HlSpan spans[HL_MAX_SPANS];
+  struct HlCache *hl = &line->hl;
+  struct RowText t = row_text(&line->row);
+  int end_state;
+
+  int n = highlight_row(&t, start_state, spans, HL_MAX_SPANS, &end_state);
+  n = MIN(n, HL_MAX_SPANS);
+
+  if (n > hl->cap) {
+    hl->spans = realloc(hl->spans, n * sizeof(struct HlSpan));
+    if (hl->spans == NULL) {
+      fatal_err("can't allocate highlight cache");
+    }
+    hl->cap = n;
+  }
+
+  memcpy(hl->spans, spans, n * sizeof(struct HlSpan));
+  hl->nspans = n;
+  hl->start_state = start_state;
+  hl->end_state = end_state;
+  hl->valid = 1;
+}
+
+// marks the cached highlighting of row r stale
+void highlight_invalidate(struct Buffer *buf, unsigned long r) {
+  buffer_line(buf, r)->hl.valid = 0;
+  buf->hl_upto = MIN(buf->hl_upto, r);
+  buf->hl_dirty_max = MAX(buf->hl_dirty_max, (long) r);
+}
+
+// brings the cached highlighting of rows first..last up to date. Rows are
+// relexed from the last row known to be consistent only until the state
+// carried from row to row converges with what is cached
+void highlight_update(struct Buffer *buf, unsigned long first, unsigned long last) {
+  unsigned long r = buf->hl_upto;
+  struct LineIter it;
+  struct Line *line;
+  int state = HL_STATE_NORMAL;
+
+  if (last >= buf->size) {
+    last = buf->size - 1;
+  }
+
+  if (first > r + HL_SYNC_LINES) {
+    // too far below the consistent rows to lex everything above the
+    // screen, guess the state at first; hl_upto catches up later
+    line = line_iter_start(buf, first, &it);
+    for (r = first; r <= last && line != NULL; ++r, line = line_iter_next(&it)) {
+      if (!line->hl.valid || (r > first && line->hl.start_state != state)) {
+        highlight_cache_line(line, state);
+      }
+      state = line->hl.end_state;
+    }
+    return;
+  }
+
+  if (r > 0) {
+    state = buffer_line(buf, r - 1)->hl.end_state;
+  }
+
+  line = line_iter_start(buf, r, &it);
+  for (; line != NULL; ++r, line = line_iter_next(&it)) {
+    if (!line->hl.valid || line->hl.start_state != state) {
+      highlight_cache_line(line, state);
+    } else if ((long) r > buf->hl_dirty_max) {
+      // nothing stale from here on
+      r = buf->size;
+      break;
+    }
+    state = line->hl.end_state;
+
+    if (r >= last) {
+      r++;
+      break;
+    }
+  }
+
+  buf->hl_upto = r;
+  if (r >= buf->size) {
+    buf->hl_dirty_max = -1;
+  }
+}
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE // memmem
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "editor.h"
+
+// reads whatever the tty or the script has into the ring, blocking
+// until there is something; returns -1 if a signal came first
+int input_fill(struct Input *in) {
+  unsigned long used = in->tail - in->head;
+  unsigned long at = in->tail % INPUT_RING_SIZE;
+  unsigned long room = MIN(INPUT_RING_SIZE - used, INPUT_RING_SIZE - at);
+
+  if (room == 0) {
+    return 0;
+  }
+
+  ssize_t n = read(in->fd, in->ring + at, room);
+  if (n < 0 && errno == EINTR) {
+    return -1;
+  }
+  if (n < 0) {
+    fatal_err("read error");
+  }
+  if (n > 0 && in->record >= 0 && write_full(in->record, (char *) in->ring + at, n) < 0) {
+    fatal_err("can't write the keys recorded");
+  }
+
+  in->eof = n == 0;
+  in->tail += n;
+  return 0;
+}
+
+static int key_csi_tilde(int n) {
+  switch (n) {
+    case 1: case 7: return K_HOME;
+    case 2: return K_INSERT;
+    case 3: return K_DELETE;
+    case 4: case 8: return K_END;
+    case 5: return K_PGUP;
+    case 6: return K_PGDN;
+    case 200: return K_PASTE;
+  }
+  return K_UNKNOWN;
+}
+
+static int key_final(unsigned char c) {
+  switch (c) {
+    case 'A': return K_UP;
+    case 'B': return K_DOWN;
+    case 'C': return K_RIGHT;
+    case 'D': return K_LEFT;
+    case 'H': return K_HOME;
+    case 'F': return K_END;
+  }
+  return K_UNKNOWN;
+}
+
+enum key_state {
+  KS_START,
+  KS_ESC,
+  KS_CSI,
+  KS_SS3,
+  KS_UTF8
+};
+
+// decodes the key at the start of the n bytes at s into key and returns
+// how many bytes it took, or 0 if the bytes end in the middle of a key.
+// With final set nothing more is coming: a lone ESC is the escape key
+// and a cut off sequence is taken as far as it goes
+int key_parse(const unsigned char *s, int n, int final, struct Key *key) {
+  int state = KS_START;
+  int params[2] = { 0, 0 }, nparams = 0;
+  int need = 0;
+
+  key->code = K_UNKNOWN;
+  key->mods = 0;
+  key->len = 0;
+
+  for (int i = 0; i < n; ++i) {
+    unsigned char c = s[i];
+
+    switch (state) {
+      case KS_START:
+        if (c == '\033') {
+          state = KS_ESC;
+        } else if (c < 0x80) {
+          key->code = c;
+          return i + 1;
+        } else {
+          need = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+          key->code = K_TEXT;
+          key->text[key->len++] = c;
+          if (need == 1 || need > 4 || c >= 0xf8) { // not a lead byte
+            return i + 1;
+          }
+          state = KS_UTF8;
+        }
+        break;
+
+      case KS_ESC:
+        if (c == '[') {
+          state = KS_CSI;
+        } else if (c == 'O') {
+          state = KS_SS3;
+        } else {
+          // escape before a key is alt with it
+          int k = key_parse(s + i, n - i, final, key);
+          key->mods |= K_MOD_ALT;
+          return k ? i + k : 0;
+        }
+        break;
+
+      case KS_CSI:
+        if (c >= '0' && c <= '9') {
+          if (nparams == 0) {
+            nparams = 1;
+          }
+          if (nparams <= 2) {
+            params[nparams - 1] = params[nparams - 1] * 10 + c - '0';
+          }
+        } else if (c == ';') {
+          nparams = nparams == 0 ? 2 : nparams + 1;
+        } else if (c >= 0x40 && c <= 0x7e) {
+          key->code = c == '~' ? key_csi_tilde(params[0]) : key_final(c);
+          if (nparams >= 2 && params[1] > 1) {
+            key->mods = (params[1] - 1) & (K_MOD_SHIFT | K_MOD_ALT | K_MOD_CTRL);
+          }
+          return i + 1;
+        } else if (c < 0x20 || i >= KEY_MAX_SEQ) {
+          return i; // garbage, skip what was read
+        }
+        break;
+
+      case KS_SS3:
+        key->code = key_final(c);
+        return i + 1;
+
+      case KS_UTF8:
+        if ((c & 0xc0) != 0x80) { // a broken char, keep what came before
+          return i;
+        }
+        key->text[key->len++] = c;
+        if (key->len == need) {
+          return i + 1;
+        }
+        break;
+    }
+  }
+
+  if (!final || n == 0) {
+    return 0;
+  }
+  if (state == KS_ESC) {
+    key->code = '\033';
+  }
+  return n;
+}
+
+// decodes the next key from the bytes read so far into key. Returns 1
+// for a key, 0 if the bytes run out in the middle of one; with final set,
+// once the escape timeout is over, a cut off sequence is taken as it is
+int input_get_key(struct Input *in, struct Key *key, int final) {
+  unsigned char seq[KEY_MAX_SEQ + 8];
+  int n = MIN(in->tail - in->head, (unsigned long) sizeof(seq));
+
+  for (int k = 0; k < n; ++k) {
+    seq[k] = in->ring[(in->head + k) % INPUT_RING_SIZE];
+  }
+
+  int used = key_parse(seq, n, final || n == sizeof(seq), key);
+  in->head += used;
+  return used > 0;
+}
+
+// reads a bracketed paste up to its end marker, the K_PASTE key that
+// began it already taken. Returns the text in a malloc'd buffer with
+// carriage returns made newlines, its length in len
+char *input_read_paste(struct Input *in, unsigned long *len) {
+  static const char end_mark[] = "\033[201~";
+  const unsigned long mark_len = sizeof(end_mark) - 1;
+  unsigned long n = 0, cap = INPUT_RING_SIZE;
+  char *text = malloc(cap);
+  char *end = NULL;
+
+  if (text == NULL) {
+    fatal_err("can't allocate paste buffer");
+  }
+
+  while (end == NULL) {
+    if (in->head == in->tail && input_fill(in) < 0) {
+      continue; // a resize, it is redrawn after the paste
+    }
+    if (in->head == in->tail && in->eof) {
+      break; // cut off, the paste is what came
+    }
+
+    unsigned long avail = in->tail - in->head;
+    if (n + avail > cap) {
+      cap = MAX(cap * 2, n + avail);
+      if ((text = realloc(text, cap)) == NULL) {
+        fatal_err("can't allocate paste buffer");
+      }
+    }
+
+    // the marker may straddle two reads
+    unsigned long from = n > mark_len ? n - mark_len : 0;
+    for (; in->head != in->tail; ++in->head) {
+      text[n++] = in->ring[in->head % INPUT_RING_SIZE];
+    }
+    end = memmem(text + from, n - from, end_mark, mark_len);
+  }
+
+  // give back what came after the marker
+  if (end != NULL) {
+    in->head -= text + n - (end + mark_len);
+    n = end - text;
+  }
+
+  unsigned long k = 0;
+  for (unsigned long i = 0; i < n; ++i) {
+    if (text[i] != '\r') {
+      text[k++] = text[i];
+    } else if (i + 1 == n || text[i + 1] != '\n') {
+      text[k++] = '\n';
+    }
+  }
+
+  *len = k;
+  return text;
+}
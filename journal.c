@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "editor.h"
+
+#define JOURNAL_MAGIC "brjrnl1\n"
+#define JOURNAL_SYNC_MS 100
+#define JOURNAL_COMPACT_MIN (64UL << 20)
+
+enum journal_type {
+  J_EDIT = 1,
+  J_RESET,   // control: start a new journal, a head and a path follow
+  J_COMPACT  // control: snapshot line, del bytes long, holds the edits
+             // up to stream pos col
+};
+
+// an edit as it is journaled: del chars go at line, col, then the len
+// chars following the record go in. Controls travel between the edits
+// to the writer but are never written
+struct JournalRec {
+  unsigned sum; // of the rest of the record and its text
+  unsigned type;
+  unsigned long line, col;
+  unsigned long del;
+  unsigned long len;
+};
+
+struct Journal journal = { .fd = -1 };
+
+// where the journal of filename goes, .name.swp next to it
+void journal_path(const char *filename, char *path, size_t n) {
+  const char *slash = strrchr(filename, '/');
+  int dir = slash == NULL ? 0 : slash - filename + 1;
+  snprintf(path, n, "%.*s.%s.swp", dir, filename, filename + dir);
+}
+
+static void snapshot_path(const char *path, unsigned long id, char *out, size_t n) {
+  snprintf(out, n, "%s.%lu", path, id);
+}
+
+// FNV-1a, enough to tell a record a crash cut short
+static unsigned journal_sum(const char *s, unsigned long n) {
+  unsigned h = 2166136261u;
+  for (unsigned long k = 0; k < n; ++k) {
+    h = (h ^ (unsigned char) s[k]) * 16777619u;
+  }
+  return h;
+}
+
+static unsigned journal_head_sum(const struct JournalHead *head) {
+  unsigned long from = offsetof(struct JournalHead, crlf);
+  return journal_sum((const char *) head + from, sizeof(struct JournalHead) - from);
+}
+
+// reads the head of the journal in fd; returns whether it is a sound one
+static int journal_read_head(int fd, struct JournalHead *head) {
+  return pread(fd, head, sizeof(struct JournalHead), 0) == sizeof(struct JournalHead) &&
+         memcmp(head->magic, JOURNAL_MAGIC, sizeof(head->magic)) == 0 &&
+         head->sum == journal_head_sum(head);
+}
+
+// queues a record for the writer; this is all journaling costs the
+// editing thread
+static void journal_append(const struct JournalRec *rec, const char *text) {
+  unsigned long n = sizeof(struct JournalRec) + rec->len;
+
+  pthread_mutex_lock(&journal.lock);
+  if (journal.len + n > journal.cap) {
+    journal.cap = MAX(journal.cap * 2, journal.len + n + 4096);
+    journal.pending = realloc(journal.pending, journal.cap);
+    if (journal.pending == NULL) {
+      fatal_err("can't allocate journal");
+    }
+  }
+  if (journal.len == 0) {
+    journal.since = now_ms();
+  }
+  memcpy(journal.pending + journal.len, rec, sizeof(struct JournalRec));
+  if (rec->len > 0) {
+    memcpy(journal.pending + journal.len + sizeof(struct JournalRec), text, rec->len);
+  }
+  journal.len += n;
+  pthread_mutex_unlock(&journal.lock);
+  pthread_cond_signal(&journal.wake);
+}
+
+// journals an edit of the buffer: the del chars at line, col make way
+// for the len chars at s
+void journal_edit(unsigned long line, unsigned long col, unsigned long del,
+                  const char *s, unsigned long len) {
+  if (!journal.on) {
+    return;
+  }
+
+  struct JournalRec rec = { .type = J_EDIT, .line = line, .col = col, .del = del, .len = len };
+  journal_append(&rec, s);
+  journal.pos += sizeof(struct JournalRec) + len;
+}
+
+// the writer gives up on a journal it can't write until the next reset,
+// leaving the error for the editing thread to show
+static void journal_fail(int err) {
+  if (journal.fd >= 0) {
+    close(journal.fd);
+    journal.fd = -1;
+  }
+  pthread_mutex_lock(&journal.lock);
+  journal.stats.err = err;
+  pthread_mutex_unlock(&journal.lock);
+}
+
+static void journal_write(const char *s, unsigned long n) {
+  if (journal.fd < 0 || n == 0) {
+    return;
+  }
+  if (write_full(journal.fd, s, n) < 0) {
+    journal_fail(errno);
+    return;
+  }
+  journal.size += n;
+  journal.dirty = 1;
+}
+
+static void journal_drop_snapshot(void) {
+  char snap[sizeof(journal.wpath) + 24];
+
+  if (journal.head.snapshot != 0) {
+    snapshot_path(journal.wpath, journal.head.snapshot, snap, sizeof(snap));
+    unlink(snap);
+  }
+}
+
+// starts a journal at path over whatever was journaled before
+static void journal_open(const struct JournalHead *head, const char *path) {
+  if (journal.fd >= 0) {
+    close(journal.fd);
+  }
+  journal_drop_snapshot();
+  if (journal.wpath[0] != 0 && strcmp(journal.wpath, path) != 0) {
+    unlink(journal.wpath);
+  }
+
+  snprintf(journal.wpath, sizeof(journal.wpath), "%s", path);
+  journal.head = *head;
+  journal.size = 0;
+  journal.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (journal.fd < 0) {
+    journal_fail(errno);
+    return;
+  }
+  journal_write((const char *) head, sizeof(struct JournalHead));
+}
+
+// replaces the journal with one starting from snapshot id, which holds
+// the edits up to stream pos mark. The records after mark are copied
+// over and the new journal renamed over the old, so a crash finds one
+// or the other whole
+static void journal_compact(unsigned long id, unsigned long mark, unsigned long size) {
+  char tmp[sizeof(journal.wpath) + 8], snap[sizeof(journal.wpath) + 24];
+  struct JournalHead head = journal.head;
+  unsigned long from = sizeof(struct JournalHead) + mark - journal.file_base;
+
+  snapshot_path(journal.wpath, id, snap, sizeof(snap));
+  if (journal.fd < 0) {
+    unlink(snap);
+    return;
+  }
+
+  head.snapshot = id;
+  head.base_size = size;
+  head.sum = journal_head_sum(&head);
+
+  snprintf(tmp, sizeof(tmp), "%s.new", journal.wpath);
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  char *chunk = malloc(SAVE_CHUNK);
+  int err = fd < 0 || chunk == NULL || write_full(fd, (const char *) &head, sizeof(head)) < 0;
+
+  for (unsigned long off = from; !err && off < journal.size;) {
+    ssize_t n = pread(journal.fd, chunk, MIN((unsigned long) SAVE_CHUNK, journal.size - off), off);
+    err = n <= 0 || write_full(fd, chunk, n) < 0;
+    off += n;
+  }
+  free(chunk);
+
+  if (err || fsync(fd) < 0 || rename(tmp, journal.wpath) < 0) {
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp);
+    }
+    unlink(snap);
+    return;
+  }
+  fsync_dir(journal.wpath);
+
+  journal_drop_snapshot();
+  close(journal.fd);
+  journal.fd = fd;
+  journal.head = head;
+  journal.size = sizeof(head) + journal.size - from;
+  journal.file_base = mark;
+
+  pthread_mutex_lock(&journal.lock);
+  journal.stats.snapshots++;
+  pthread_mutex_unlock(&journal.lock);
+}
+
+// writes a batch taken from the queue, summing the edits on the way and
+// carrying out the controls between them
+static void journal_write_batch(char *s, unsigned long n, double since) {
+  double start = now_ms();
+  unsigned long edits = 0, from = 0;
+  unsigned long skip = offsetof(struct JournalRec, type);
+
+  for (unsigned long off = 0; off < n;) {
+    struct JournalRec rec;
+    memcpy(&rec, s + off, sizeof(rec));
+    unsigned long size = sizeof(rec) + rec.len;
+
+    if (rec.type == J_EDIT) {
+      unsigned sum = journal_sum(s + off + skip, size - skip);
+      memcpy(s + off, &sum, sizeof(sum));
+      journal.wpos += size;
+      off += size;
+      edits++;
+      continue;
+    }
+
+    journal_write(s + from, off - from);
+    const char *text = s + off + sizeof(rec);
+    if (rec.type == J_RESET) {
+      struct JournalHead head;
+      char path[sizeof(journal.wpath)];
+
+      memcpy(&head, text, sizeof(head));
+      snprintf(path, sizeof(path), "%.*s", (int) (rec.len - sizeof(head)), text + sizeof(head));
+      journal_open(&head, path);
+      journal.file_base = journal.wpos;
+    } else if (rec.type == J_COMPACT) {
+      journal_compact(rec.line, rec.col, rec.del);
+    }
+    off += size;
+    from = off;
+  }
+  journal_write(s + from, n - from);
+
+  double end = now_ms();
+  pthread_mutex_lock(&journal.lock);
+  journal.stats.edits += edits;
+  journal.stats.bytes += n;
+  journal.stats.writes++;
+  journal.stats.write_ms += end - start;
+  journal.stats.lag_ms += end - since;
+  journal.stats.lag_max_ms = MAX(journal.stats.lag_max_ms, end - since);
+  pthread_mutex_unlock(&journal.lock);
+}
+
+static void journal_sync(void) {
+  double start = now_ms();
+
+  if (journal.fd >= 0 && fdatasync(journal.fd) < 0) {
+    journal_fail(errno);
+  }
+  journal.last_sync = now_ms();
+  journal.dirty = 0;
+
+  double ms = journal.last_sync - start;
+  pthread_mutex_lock(&journal.lock);
+  journal.stats.fsyncs++;
+  journal.stats.fsync_ms += ms;
+  journal.stats.fsync_max_ms = MAX(journal.stats.fsync_max_ms, ms);
+  pthread_mutex_unlock(&journal.lock);
+}
+
+// the writer thread: takes the whole queue at a time and writes it out
+// right away, so a crash of the editor loses nothing, while the fsyncs
+// that guard against losing power are grouped to one per JOURNAL_SYNC_MS
+static void *journal_main(void *arg) {
+  char *batch = NULL;
+  unsigned long cap = 0;
+
+  pthread_mutex_lock(&journal.lock);
+  while (!journal.stop || journal.len > 0) {
+    if (journal.len == 0 && !journal.dirty) {
+      pthread_cond_wait(&journal.wake, &journal.lock);
+    } else if (journal.len == 0) {
+      long at = journal.last_sync + JOURNAL_SYNC_MS + 1;
+      struct timespec ts = { .tv_sec = at / 1000, .tv_nsec = at % 1000 * 1000000 };
+      pthread_cond_timedwait(&journal.wake, &journal.lock, &ts);
+    }
+
+    // swap buffers with the editing thread
+    char *s = journal.pending;
+    unsigned long n = journal.len, scap = journal.cap;
+    double since = journal.since;
+    journal.pending = batch;
+    journal.cap = cap;
+    journal.len = 0;
+    batch = s;
+    cap = scap;
+    pthread_mutex_unlock(&journal.lock);
+
+    if (n > 0) {
+      journal_write_batch(batch, n, since);
+    }
+    if (journal.dirty && now_ms() >= journal.last_sync + JOURNAL_SYNC_MS) {
+      journal_sync();
+    }
+
+    pthread_mutex_lock(&journal.lock);
+  }
+  pthread_mutex_unlock(&journal.lock);
+
+  free(batch);
+  return NULL;
+}
+
+static void journal_start(void) {
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&journal.wake, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&journal.lock, NULL);
+
+  if (pthread_create(&journal.thread, NULL, journal_main, NULL) != 0) {
+    fatal_err("can't start the journal thread");
+  }
+  journal.on = 1;
+}
+
+// starts the journal over from buf's file as it is on disk now
+void journal_reset(struct Buffer *buf) {
+  struct JournalHead head;
+  struct stat st;
+  char text[sizeof(struct JournalHead) + sizeof(journal.path)];
+
+  if (buf->filename[0] == 0 || journal.off) {
+    return;
+  }
+
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, JOURNAL_MAGIC, sizeof(head.magic));
+  head.crlf = buf->crlf;
+  if (stat(buf->filename, &st) == 0) {
+    head.base_size = st.st_size;
+    head.base_mtime = st.st_mtim;
+  }
+  head.sum = journal_head_sum(&head);
+
+  journal_path(buf->filename, journal.path, sizeof(journal.path));
+  unsigned long n = strlen(journal.path);
+  memcpy(text, &head, sizeof(head));
+  memcpy(text + sizeof(head), journal.path, n);
+
+  if (!journal.on) {
+    journal_start();
+  }
+  struct JournalRec rec = { .type = J_RESET, .len = sizeof(head) + n };
+  journal_append(&rec, text);
+  journal.base_pos = journal.pos;
+}
+
+static unsigned long buffer_bytes(const struct Buffer *buf) {
+  return buf->tree->nbytes + (buf->indexed ? 0 : buf->map_len - buf->map_next);
+}
+
+// forks a child that writes the buffer as it is now to a snapshot, to
+// compact the journal to once it is done. The child gets its own copy of
+// the buffer for free, so editing goes on meanwhile. Returns the errno
+// of a failed fork, 0 otherwise
+static int journal_snapshot(struct Buffer *buf) {
+  unsigned long id = journal.snapshot + 1;
+  char path[sizeof(journal.child_path)];
+
+  snapshot_path(journal.path, id, path, sizeof(path));
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    unsigned long bytes;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    _exit(fd < 0 || save_write(fd, buf, &bytes) < 0 || fsync(fd) < 0 || close(fd) < 0);
+  }
+  if (pid < 0) {
+    return errno;
+  }
+
+  journal.snapshot = id;
+  journal.child = pid;
+  journal.child_id = id;
+  journal.child_pos = journal.pos;
+  snprintf(journal.child_path, sizeof(journal.child_path), "%s", path);
+  return 0;
+}
+
+// hands a finished snapshot to the writer and takes a new one once the
+// journal outgrew the text, so recovering never replays more than that.
+// Run every JOURNAL_CHECK_MS; returns the errno of the last thing that
+// failed since, 0 if nothing did
+int journal_check(struct Buffer *buf) {
+  int status, err = 0;
+  struct stat st;
+
+  if (!journal.on) {
+    return 0;
+  }
+
+  if (journal.child > 0 && waitpid(journal.child, &status, WNOHANG) == journal.child) {
+    // a save since the fork made the snapshot useless
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && journal.child_pos > journal.base_pos &&
+        stat(journal.child_path, &st) == 0) {
+      struct JournalRec rec = { .type = J_COMPACT, .line = journal.child_id,
+                                .col = journal.child_pos, .del = st.st_size };
+      journal_append(&rec, NULL);
+      journal.base_pos = journal.child_pos;
+    } else {
+      unlink(journal.child_path);
+    }
+    journal.child = 0;
+  }
+
+  if (journal.child == 0 && journal.pos - journal.base_pos > MAX(JOURNAL_COMPACT_MIN, buffer_bytes(buf))) {
+    err = journal_snapshot(buf);
+  }
+
+  pthread_mutex_lock(&journal.lock);
+  err = journal.stats.err != 0 ? journal.stats.err : err;
+  journal.stats.err = 0;
+  pthread_mutex_unlock(&journal.lock);
+  return err;
+}
+
+// stops the writer and removes the journal, its edits being saved or
+// thrown away by now
+void journal_stop(void) {
+  if (!journal.on) {
+    return;
+  }
+
+  pthread_mutex_lock(&journal.lock);
+  journal.stop = 1;
+  pthread_mutex_unlock(&journal.lock);
+  pthread_cond_signal(&journal.wake);
+  pthread_join(journal.thread, NULL);
+  journal.on = 0;
+
+  if (journal.child > 0) {
+    kill(journal.child, SIGKILL);
+    waitpid(journal.child, NULL, 0);
+    unlink(journal.child_path);
+  }
+  if (journal.fd >= 0) {
+    close(journal.fd);
+  }
+  journal_drop_snapshot();
+  if (journal.wpath[0] != 0) {
+    unlink(journal.wpath);
+  }
+}
+
+// whether an editor left a journal of filename behind
+int journal_exists(const char *filename) {
+  char path[sizeof(journal.path)];
+  struct JournalHead head;
+
+  journal_path(filename, path, sizeof(path));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  int ok = journal_read_head(fd, &head);
+  close(fd);
+  return ok;
+}
+
+// loads the file the journal of buf's file starts from, replays the
+// edits in it up to the first one a crash cut short, and goes on
+// journaling there; returns how many edits it replayed
+unsigned long journal_recover(struct Buffer *buf) {
+  char path[sizeof(journal.path)];
+  struct JournalHead head;
+  struct stat st, fst;
+
+  journal_path(buf->filename, path, sizeof(path));
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0 || !journal_read_head(fd, &head)) {
+    fprintf(stderr, "no journal to recover %s from\n", buf->filename);
+    exit(1);
+  }
+
+  if (head.snapshot != 0) {
+    char snap[sizeof(path) + 24];
+    snapshot_path(path, head.snapshot, snap, sizeof(snap));
+    buffer_read(buf, snap);
+  } else {
+    int exists = stat(buf->filename, &fst) == 0;
+    if (exists ? fst.st_size != head.base_size || fst.st_mtim.tv_sec != head.base_mtime.tv_sec ||
+                 fst.st_mtim.tv_nsec != head.base_mtime.tv_nsec
+               : head.base_size != 0) {
+      fprintf(stderr, "%s changed since its journal was written, not recovering\n", buf->filename);
+      exit(1);
+    }
+    if (exists) {
+      buffer_read(buf, buf->filename);
+    }
+  }
+  buf->crlf = head.crlf;
+
+  const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    fatal_err("can't map journal");
+  }
+
+  unsigned long off = sizeof(head), edits = 0, r = 0, c = 0;
+  unsigned long skip = offsetof(struct JournalRec, type);
+  while (off + sizeof(struct JournalRec) <= (unsigned long) st.st_size) {
+    struct JournalRec rec;
+    memcpy(&rec, map + off, sizeof(rec));
+    unsigned long size = sizeof(rec) + rec.len;
+
+    if (rec.type != J_EDIT || rec.len > st.st_size - off - sizeof(rec) ||
+        rec.sum != journal_sum(map + off + skip, size - skip)) {
+      break;
+    }
+    buffer_index(buf, rec.line + 2);
+    if (rec.line >= buf->size || rec.col > row_len(&buffer_line(buf, rec.line)->row)) {
+      break;
+    }
+
+    r = rec.line;
+    c = rec.col;
+    if (rec.del > 0) {
+      buffer_delete(buf, rec.line, rec.col, rec.del);
+    }
+    if (rec.len > 0) {
+      buffer_insert(buf, rec.line, rec.col, map + off + sizeof(rec), rec.len, &r, &c);
+    }
+    off += size;
+    edits++;
+  }
+  munmap((void *) map, st.st_size);
+
+  // what follows the last sound record goes, new edits are written there
+  if (off < (unsigned long) st.st_size && ftruncate(fd, off) < 0) {
+    fatal_err("can't truncate journal");
+  }
+  lseek(fd, off, SEEK_SET);
+
+  buf->cx = r;
+  buf->cy = c;
+  snprintf(journal.path, sizeof(journal.path), "%s", path);
+  snprintf(journal.wpath, sizeof(journal.wpath), "%s", path);
+  journal.fd = fd;
+  journal.head = head;
+  journal.size = off;
+  journal.pos = journal.wpos = off - sizeof(head);
+  journal.snapshot = head.snapshot;
+  journal_start();
+  return edits;
+}
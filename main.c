@@ -1,178 +1,92 @@
+#define _GNU_SOURCE // pipe2
+
 #include <curses.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <term.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-#define DEBUG 1
-#define TAB_SIZE 2
-#define NUMBER 1
-#define ANSI_RGB_COLOR_FORMAT "\033[38;2;%d;%d;%dm"
-#define ANSI_RESET_COLOR "\033[0m"
-
-const char *keywords[] = {
-  "while", 
-  "for", 
-  "if", 
-  "else", 
-  "switch",
-  "case",
-  "return"
-};
-
-const char *data_types[] = {
-  "int",
-  "float",
-  "double",
-  "char",
-  "void",
-  "unsigned",
-  "long",
-  "sizeof"
-};
+#include "editor.h"
 
-const char *operands[] = {
-  "+",
-  "-",
-  "=",
-  ";",
-  "<",
-  ">",
-  "!",
-  "%",
-  "&",
-  "|",
-  "<<",
-  ">>",
-  "++",
-  "--",
-  "+=",
-  "-=",
-  "/=",
-  "*=",
-  "<=",
-  ">=",
-  "==",
-  "!=",
-  "&&",
-  "||"
+#define NUMBER 1
+#define ESC_TIMEOUT_MS 25
+#define STATUS_TIMEOUT_MS 5000
+#define FPS_DEFAULT 60
+#define STATS_OVERLAY_MS 500
+
+// things the event loop does at a set time
+enum timer_id {
+  TIMER_ESC,     // a cut off key sequence is taken as it is
+  TIMER_STATUS,  // the status message goes away
+  TIMER_JOURNAL, // the journal is checked for a snapshot to take or reap
+  TIMER_STATS,   // the stats overlay is redrawn
+  TIMER_COUNT
 };
 
-// returns {length of highlight_word, highlight_type}
-int* is_highlight(const char* word) {
-  int *ret = malloc(2 * sizeof(int));
-  for (int i = 0; i < sizeof(keywords) / sizeof(keywords[0]); ++i) {
-    if (strcmp(keywords[i], word) == 0) {
-      ret[0] = strlen(keywords[i]);
-      ret[1] = 0;
-      return ret;
-    }
-  }
-
-  for (int i = 0; i < sizeof(data_types) / sizeof(data_types[0]); ++i) {
-    if (strcmp(data_types[i], word) == 0) {
-      ret[0] = strlen(data_types[i]);
-      ret[1] = 1;
-      return ret;
-    }
-  }
-
-  for (int i = 0; i < sizeof(operands) / sizeof(operands[0]); ++i) {
-    if (strcmp(operands[i], word) == 0) {
-      ret[0] = strlen(operands[i]);
-      ret[1] = 2;
-      return ret;
-    }
-  }
-
-  free(ret);
-  return NULL;
-}
+struct termios orig_termios;
 
-#define MAX(a, b) \
-  ({ __typeof__(a) a_ = (a); \
-     __typeof__(b) b_ = (b); \
-     a_ > b_ ? a_ : b_; })
+// set from the SIGWINCH handler, the next frame re-reads the screen size
+volatile sig_atomic_t winch_pending = 0;
 
-#define MIN(a, b) \
-  ({ __typeof__(a) a_ = (a); \
-     __typeof__(b) b_ = (b); \
-     a_ < b_ ? a_ : b_; })
+// shown on the last line of the screen until the next key or until
+// STATUS_TIMEOUT_MS pass
+char status_msg[200] = "";
 
-struct termios orig_termios;
+// set by the quit key, ends the main loop
+int quit_requested = 0;
 
-struct Buffer {
-  unsigned long size;
-  unsigned long r_size;
-  char **rows;
-  unsigned long *row_size;
-  unsigned long *r_row_size;
-  int cx, cy; // cursor position
-  int *tabs;
+// the event loop waits on the tty, the SIGWINCH pipe and the timers
+// and draws at most one frame every frame_ms
+struct Loop {
+  double frame_ms;
+  double last_frame;
+  int dirty;                 // something changed since the last frame
+  double timer[TIMER_COUNT]; // when each timer goes off, 0 if it is unset
+  int winch_pipe[2];         // the signal handler writes a byte here
 };
 
-struct Screen {
-  unsigned int lins;
-  unsigned int cols;
+struct Loop loop = { .frame_ms = 1000.0 / FPS_DEFAULT, .winch_pipe = { -1, -1 } };
+
+struct Input input = { .fd = STDIN_FILENO, .record = -1 };
+
+// the last search, kept so a query typed one char further can go on
+// from the match already found
+struct Search {
+  char query[200];
+  unsigned long len;
+  int found;
+  unsigned long line, col;          // the match, if found
+  int dir;                           // 1 forward, -1 backward
+  unsigned long from_line, from_col; // where the cursor was when it began
+  unsigned long from_top;
+  int from_top_sub;                  // and its screen line, in wrap mode
+  int show;                          // mark the matches on screen
 };
 
-void Buffer_dealocate(struct Buffer*);
-void fatal_err(char*);
-unsigned *get_term_lcol(void);
-int tty_reset(void);
-void tty_atexit(void);
-void tty_raw(void);
-int render_buf(struct Buffer *, struct Screen*, int);
-
-void print_debug(const char *msg) {
-  char nmsg[300];
-
-  write(STDOUT_FILENO, "\033[2J", 4);
-  strcpy(nmsg, msg);
-  strcat(nmsg, "\r\n");
-
-  write(STDOUT_FILENO, nmsg, strlen(nmsg));
-  char dum;
-
-  read(STDIN_FILENO, &dum, 1);
-
-}
-
-void Buffer_dealocate(struct Buffer *buf) {
-  if (buf->size > 0) {
-    for (int i = 0; i < buf->r_size; ++i) {
-      if (buf->rows[i] != NULL) {
-        free(buf->rows[i]);
-        buf->rows[i] = NULL;
-      }
-    }
-
-    if (buf->row_size != NULL) {
-      free(buf->row_size);
-      buf->row_size = NULL;
-    }
-
-    if (buf->r_row_size != NULL) {
-      free(buf->r_row_size);
-      buf->r_row_size = NULL;
-    }
-
-    if (buf->rows != NULL) {
-      free(buf->rows);
-      buf->rows = NULL;
-    }
-  }
+struct Search search;
 
-  buf->size = 0;
+// workers a replace runs on, the cpus online unless --jobs says
+int replace_jobs = 1;
 
-  if (buf != NULL) {
-    free(buf);
-    buf = NULL;
-  }
+void status_set(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(status_msg, sizeof(status_msg), fmt, ap);
+  va_end(ap);
+  loop.timer[TIMER_STATUS] = now_ms() + STATUS_TIMEOUT_MS;
 }
 
 unsigned *get_term_lcol(void) {
@@ -244,16 +158,43 @@ unsigned *get_term_lcol(void) {
   return lcol;
 }
 
+// asks the tty for its size, falling back to terminfo when it won't say
+void screen_update_size(struct Screen *scr) {
+  struct winsize ws;
+
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0) {
+    screen_resize(scr, ws.ws_row, ws.ws_col);
+    return;
+  }
+
+  unsigned *lcol = get_term_lcol();
+  if (lcol == NULL) {
+    screen_resize(scr, scr->front ? scr->lins : 24, scr->front ? scr->cols : 80);
+    return;
+  }
+
+  screen_resize(scr, lcol[0], lcol[1]);
+  free(lcol);
+}
+
+void handle_winch(int sig) {
+  int saved_errno = errno;
+  (void) sig;
+  winch_pending = 1;
+  write(loop.winch_pipe[1], "", 1); // wakes the event loop
+  errno = saved_errno;
+}
+
 int tty_reset(void) {
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios) < 0)
     return -1;
   return 0;
 }
 
-void tty_atexit(void) { 
-  write(STDOUT_FILENO, "\033[2J", 4);
-  write(STDOUT_FILENO, "\033[0;0H", 6);
-  // write()
+void tty_atexit(void) {
+  render_stop();
+  frame_puts(&frame, ANSI_RESET_COLOR "\033[?2004l\033[2J\033[0;0H");
+  frame_flush(&frame);
   tty_reset();
 }
 
@@ -267,624 +208,1109 @@ void tty_raw(void) {
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
   // control chars
-  raw.c_cc[VMIN] = 5;
-  raw.c_cc[VTIME] = 8; /* after 5 bytes or .8 seconds after first byte seen */
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0; /* as soon as there is a byte, the decoder waits for the rest */
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) < 0) fatal_err("can't set raw mode");
 }
 
-void write_to_position(int row, int column, const char* msg) {
-  char esq_sec[200];
-  sprintf(esq_sec, "\033[%d;%dH%s", row, column, msg);
-  write(STDOUT_FILENO, esq_sec, strlen(esq_sec));
+typedef void (*key_handler)(struct Buffer *, struct Screen *, const struct Key *);
+typedef void (*prompt_done)(struct Buffer *, struct Screen *, const char *);
+
+// a line of text asked for on the last line of the screen. While msg
+// is set keys edit it instead of the buffer
+struct Prompt {
+  const char *msg;
+  char text[200];
+  prompt_done done;   // gets the text once enter is pressed
+  prompt_done change; // if set, gets the text each time it changes
+  prompt_done cancel; // if set, gets the text when escape drops it
+  key_handler key;    // if set, gets the keys the prompt has no use for
+};
+
+struct Prompt prompt;
+
+void prompt_start(const char *msg, prompt_done done) {
+  prompt.msg = msg;
+  prompt.text[0] = 0;
+  prompt.done = done;
+  prompt.change = prompt.cancel = NULL;
+  prompt.key = NULL;
 }
 
-const char* get_command(const char * msg, struct Screen* scr) {
-  char c;
-  char str[200] = "";
-  char str_msg[400];
+// edits the prompt with key; enter hands the text on, escape drops it
+void prompt_key(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  size_t len = strlen(prompt.text);
+
+  if (key->code == 13 || key->code == '\n') {
+    prompt.msg = NULL;
+    prompt.done(buf, scr, prompt.text);
+    return;
+  } else if (key->code == '\033' && key->mods == 0) {
+    prompt.msg = NULL;
+    if (prompt.cancel != NULL) {
+      prompt.cancel(buf, scr, prompt.text);
+    }
+    return;
+  } else if ((key->code == 127 || key->code == 8) && len > 0) {
+    // a whole utf-8 char
+    while (len > 1 && (prompt.text[len - 1] & 0xc0) == 0x80) {
+      len--;
+    }
+    prompt.text[len - 1] = 0;
+  } else if (key->code == K_PASTE) {
+    // its first line, cut back to a whole utf-8 char if it doesn't fit
+    unsigned long n, room = sizeof(prompt.text) - 1 - len;
+    char *text = input_read_paste(&input, &n);
+    char *nl = memchr(text, '\n', n);
+    if (nl != NULL) {
+      n = nl - text;
+    }
+    if (n > room) {
+      n = room;
+      while (n > 0 && (text[n] & 0xc0) == 0x80) {
+        n--;
+      }
+    }
+    memcpy(prompt.text + len, text, n);
+    prompt.text[len + n] = 0;
+    free(text);
+  } else if (key->code == K_TEXT && len + key->len < sizeof(prompt.text)) {
+    memcpy(prompt.text + len, key->text, key->len);
+    prompt.text[len + key->len] = 0;
+  } else if (key->code >= ' ' && key->code < 127 && key->mods == 0 && len + 1 < sizeof(prompt.text)) {
+    prompt.text[len] = key->code;
+    prompt.text[len + 1] = 0;
+  } else {
+    if (prompt.key != NULL) {
+      prompt.key(buf, scr, key);
+    }
+    return;
+  }
 
-  int w_limit = 199;
-  while (w_limit--) {
-    strcpy(str_msg, msg);
-    strcat(str_msg, str);
-    write_to_position(scr->lins , 0 , str_msg);
-    read(STDIN_FILENO, &c, 1);
-    if (c == 13 || c == '\n') {
-      break;
-    } 
+  if (prompt.change != NULL) {
+    prompt.change(buf, scr, prompt.text);
+  }
+}
 
-    else if (c == 127) {
-      str[strlen(str)-1] = 0;
-    } 
+// marks the matches of the search query on the lines shown
+static void render_matches(struct Buffer *buf, struct Screen *scr, unsigned long top,
+                           unsigned int text_lins, int gutter) {
+  struct LineIter it;
+  struct Line *line = line_iter_start(buf, top, &it);
+  unsigned long m = search.len;
+
+  for (unsigned int y = 0; line != NULL && y < text_lins; ++y, line = line_iter_next(&it)) {
+    unsigned long len = row_len(&line->row);
+    const char *t = row_flat(&line->row);
+    const char *p = t;
+    struct Cell *row = scr->back + (size_t) y * scr->cols;
+
+    while ((p = text_find(p, len - (p - t), search.query, m)) != NULL) {
+      unsigned long end = line_col(line, p - t + m);
+      for (unsigned long c = line_col(line, p - t); c < end; ++c) {
+        unsigned long x = gutter + c - buf->left;
+        if (c >= buf->left && x < scr->cols) {
+          row[x].hl = HL_MATCH;
+        }
+      }
+      p += m;
+    }
+  }
+}
 
-    else {
-      strncat(str, &c, 1);
+// marks the matches of the search query on screen line k of a wrapped
+// row, drawn at row y from column x
+static void render_matches_wrapped(struct Screen *scr, unsigned int y, unsigned int x,
+                                   struct Line *line, unsigned int width, int k) {
+  unsigned long m = search.len;
+  unsigned long start = wrap_start(line, width, k), end = wrap_end(line, width, k);
+  unsigned long from = start > m ? start - m + 1 : 0, to = MIN(end + m - 1, row_len(&line->row));
+  const char *t = row_flat(&line->row);
+  const char *p = t + from;
+  struct Cell *row = scr->back + (size_t) y * scr->cols;
+
+  while ((p = text_find(p, to - (p - t), search.query, m)) != NULL) {
+    unsigned long a = MAX((unsigned long) (p - t), start), b = MIN(p - t + m, end);
+    if (a < b) {
+      unsigned long c_end = wrap_col(line, width, k, b);
+      for (unsigned long c = wrap_col(line, width, k, a); c < c_end && x + c < scr->cols; ++c) {
+        row[x + c].hl = HL_MATCH;
+      }
     }
+    p += m;
   }
+}
 
-  const char *com = (const char *) str;
+// draws the bytes of line from pos to end in their colors at row y from
+// column x, where col is the display column of pos and left the first
+// one shown
+static void render_line(struct Screen *scr, unsigned int y, unsigned int x, unsigned long left,
+                        struct Line *line, unsigned long pos, unsigned long end, unsigned long col) {
+  const struct HlSpan *spans = line->hl.spans;
+  struct RowText t = row_text(&line->row);
+  int lo = 0, hi = line->hl.nspans, more = 1;
+
+  // skip the spans ending before pos
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (spans[mid].start + spans[mid].len <= pos) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
 
-  return com;
+  for (int k = lo; k < line->hl.nspans && more && pos < end; ++k) {
+    more = screen_draw_text(scr, y, x, left, &t, &pos, MIN(spans[k].start, end), &col, HL_NORMAL) &&
+           screen_draw_text(scr, y, x, left, &t, &pos, MIN(spans[k].start + spans[k].len, end), &col,
+                            spans[k].hl);
+  }
+  if (more) {
+    screen_draw_text(scr, y, x, left, &t, &pos, end, &col, HL_NORMAL);
+  }
 }
 
-int render_buf(struct Buffer *buf, struct Screen* scr, int llimit) {
-  unsigned int *lcol = malloc(2 * sizeof(unsigned int));
-  lcol = get_term_lcol();
-  scr->lins = lcol[0];
-  scr->cols = lcol[1];
-  free(lcol);
+// the first text line of the last frame counted in screen lines, which
+// only has to move with the view for the scroll hint
+static struct {
+  unsigned long line;
+  unsigned long top; // where the view started then
+  int sub;
+} view;
+
+// draws the lines shown cut at the right edge, scrolling sideways to the
+// cursor
+static void render_rows(struct Buffer *buf, struct Screen *scr, unsigned int text_lins,
+                        int *cursor_y, int *cursor_x) {
+  // scroll just enough to keep the cursor on screen
+  if (buf->cx < buf->top) {
+    buf->top = buf->cx;
+  } else if (buf->cx >= buf->top + text_lins) {
+    buf->top = buf->cx - text_lins + 1;
+  }
 
-  write(STDOUT_FILENO, "\033[H", 3);
-  
-  long limit = MAX(0L, (long) buf->size - (long) scr->lins);
+  unsigned long limit = buf->top;
+  char scr_num[100] = "";
 
-  if (limit != llimit) {
-    write(STDOUT_FILENO, "\033[2J", 4);
+  // the line numbers all take as much room as the widest one on screen
+  int gutter = 0;
+  if (NUMBER) {
+    gutter = sprintf(scr_num, "%5lu ", limit + text_lins);
   }
 
-  for (int i = limit; i <  buf->size; ++i) {
+  unsigned int text_cols = scr->cols > gutter + 1 ? scr->cols - gutter : 1;
+  unsigned long col = cursor_col(buf);
+  if (col < buf->left) {
+    buf->left = col;
+  } else if (col >= buf->left + text_cols) {
+    buf->left = col - text_cols + 1;
+  }
 
-    if (i > limit) {
-      char c_out[] = "\r\n";
-      write(STDOUT_FILENO, c_out, 2);
-    }
+  buffer_index(buf, limit + text_lins);
+  STAT_BEGIN(STAT_HIGHLIGHT);
+  highlight_update(buf, limit, limit + text_lins - 1);
+  STAT_END(STAT_HIGHLIGHT);
 
-    char scr_num[100] = "";
+  struct LineIter it;
+  struct Line *line = line_iter_start(buf, limit, &it);
+
+  for (unsigned long i = limit; line != NULL && i < limit + text_lins; ++i, line = line_iter_next(&it)) {
+    int y = i - limit;
+    unsigned int x = 0;
 
     if (NUMBER) {
-      char color_highlight[300];
-      sprintf(color_highlight, ANSI_RGB_COLOR_FORMAT, 203, 58, 255);
-      
-      write(STDOUT_FILENO, color_highlight, strlen(color_highlight) + 1); // need to account for \033 non-printable
+      int n = sprintf(scr_num, "%*lu ", gutter - 1, i + 1);
+      x = screen_draw(scr, y, x, scr_num, n, HL_LINE_NUMBER);
+    }
 
-      sprintf(scr_num, "%5d ", i+1);
-      write(STDOUT_FILENO, scr_num, strlen(scr_num));
+    // from the cluster showing the first column, which may start left of it
+    unsigned long pos = line_byte(line, buf->left);
+    render_line(scr, y, x, buf->left, line, pos, row_len(&line->row), pos > 0 ? line_col(line, pos) : 0);
+  }
 
-      write(STDOUT_FILENO, ANSI_RESET_COLOR, strlen(ANSI_RESET_COLOR));
-    }
+  if (search.show && search.len > 0) {
+    render_matches(buf, scr, limit, text_lins, gutter);
+  }
 
+  view.line += limit - view.top;
+  view.top = limit;
+  view.sub = 0;
 
-    // print_debug("before strtok");
-    // print_debug("after strtok");
-    unsigned chars_to_write = 0;
+  // leave the cursor where the next input goes
+  *cursor_y = (int) (buf->cx - limit);
+  *cursor_x = gutter + col - buf->left;
+}
 
-    for (int j = 0; j < buf->row_size[i]; ++j) {
-      char *cpyStr = strdup(buf->rows[i]);
-      char *tok;
-      size_t tok_size = 0;
+// draws the lines shown wrapped at the screen width, scrolling by screen
+// line. Only the rows on screen get wrapped, so a resize costs no more
+// than a frame
+static void render_wrapped(struct Buffer *buf, struct Screen *scr, unsigned int text_lins,
+                           int *cursor_y, int *cursor_x) {
+  char scr_num[100] = "";
 
-      if (buf->rows[i][j] != ' ' && !tok_size) {
-        if (j == 0 || buf->rows[i][j-1] == ' ') {
-          tok = strtok(cpyStr+j, " ");
-          tok_size = strlen(tok);
-        }
-      }
+  // no line shown is further down than the cursor's one a screen on
+  int gutter = 0;
+  if (NUMBER) {
+    gutter = sprintf(scr_num, "%5lu ", (unsigned long) buf->cx + text_lins);
+  }
 
-      if (tok_size) {
-        tok_size--;
-      }
+  unsigned int width = scr->cols > gutter + 1 ? scr->cols - gutter : 1;
+  buf->wrap_cols = width;
+  buf->left = 0;
 
-      int highlight_size = 0;
-      int highlight_type = 0;
+  struct Line *line = buffer_line(buf, buf->cx);
+  int sub = wrap_find(line, width, buf->cy);
+  unsigned long col = wrap_col(line, width, sub, buf->cy);
 
-      if (!highlight_size && tok != NULL) {
-        int *key = is_highlight(tok);
-        if (key != NULL) {
-          highlight_size = key[0];
-          highlight_type = key[1];
-          tok = NULL;
-        }
-      }
+  // the top row may have lost screen lines to edits or a resize
+  if (buf->top_sub > 0 && !wrap_has(buffer_line(buf, buf->top), width, buf->top_sub)) {
+    buf->top_sub = wrap_count(buffer_line(buf, buf->top), width) - 1;
+  }
 
-      if (!chars_to_write && highlight_size) {
-        char color_to_write[200];
+  // scroll just enough to keep the cursor on screen
+  if (buf->cx < buf->top || (buf->cx == buf->top && sub < buf->top_sub)) {
+    buf->top = buf->cx;
+    buf->top_sub = sub;
+  } else if (wrap_distance(buf, buf->top, buf->top_sub, buf->cx, sub, text_lins) >= (int) text_lins) {
+    unsigned long row = buf->cx;
+    int k = sub;
+    for (unsigned int n = 1; n < text_lins; ++n) {
+      wrap_step(buf, &row, &k, -1);
+    }
+    buf->top = row;
+    buf->top_sub = k;
+  }
 
-        switch (highlight_type) {
-          case 0:
-            sprintf(color_to_write, ANSI_RGB_COLOR_FORMAT, 255, 255, 51);
-            break;
+  unsigned long limit = buf->top;
+  buffer_index(buf, limit + text_lins);
+  STAT_BEGIN(STAT_HIGHLIGHT);
+  highlight_update(buf, limit, limit + text_lins - 1);
+  STAT_END(STAT_HIGHLIGHT);
 
-          case 1:
-            sprintf(color_to_write, ANSI_RGB_COLOR_FORMAT, 0, 186, 155);
-            break;
+  struct LineIter it;
+  unsigned int y = 0;
+  line = line_iter_start(buf, limit, &it);
 
-          case 2:
-            sprintf(color_to_write, ANSI_RGB_COLOR_FORMAT, 0, 255, 239);
-            break;
-        }
-        write(STDOUT_FILENO, color_to_write, strlen(color_to_write) + 1);
-        chars_to_write = highlight_size;
-      } 
+  for (unsigned long i = limit; line != NULL && y < text_lins; ++i, line = line_iter_next(&it)) {
+    int k = i == limit ? buf->top_sub : 0;
 
-      else if (!chars_to_write) {
-        write(STDOUT_FILENO, ANSI_RESET_COLOR, strlen(ANSI_RESET_COLOR)+1);
+    do {
+      if (NUMBER && k == 0) {
+        int n = sprintf(scr_num, "%*lu ", gutter - 1, i + 1);
+        screen_draw(scr, y, 0, scr_num, n, HL_LINE_NUMBER);
       }
 
-      else {
-        chars_to_write--;
+      render_line(scr, y, gutter, 0, line, wrap_start(line, width, k), wrap_end(line, width, k), 0);
+      if (search.show && search.len > 0) {
+        render_matches_wrapped(scr, y, gutter, line, width, k);
+      }
+      if (i == (unsigned long) buf->cx && k == sub) {
+        *cursor_y = y;
       }
+      y++;
+      k++;
+    } while (y < text_lins && wrap_has(line, width, k));
+  }
 
-      char c_out = buf->rows[i][j];
-      write(STDOUT_FILENO, &c_out, 1);
-      free(cpyStr);
-    }
+  // screen lines the view moved since the last frame, as far as a screen
+  long moved;
+  if (view.top >= buf->size) {
+    moved = text_lins;
+  } else if (limit > view.top || (limit == view.top && buf->top_sub >= view.sub)) {
+    moved = wrap_distance(buf, view.top, view.sub, limit, buf->top_sub, text_lins);
+  } else {
+    moved = -wrap_distance(buf, limit, buf->top_sub, view.top, view.sub, text_lins);
   }
-  return limit;
-}
+  view.line += moved;
+  view.top = limit;
+  view.sub = buf->top_sub;
 
-int get_input(struct Buffer* buf, struct Screen *scr) {
-  char c_in;
-  int bytesread;
+  *cursor_x = gutter + col;
+}
 
-  char esc_seq[300];
-  int start = MAX(0, (int) buf->size - (int) scr->lins);
+void render_buf(struct Buffer *buf, struct Screen* scr) {
+  STAT_BEGIN(STAT_RENDER);
 
-  char scr_number[100] = "";
-  if (NUMBER) {
-    sprintf(scr_number, "%5d ", buf->cx + 1);
+  if (winch_pending) {
+    winch_pending = 0;
+    screen_update_size(scr);
   }
 
-  int rx = (int) buf->cx - start + 1;
-
-  sprintf(esc_seq, "\033[%d;%luH", rx, buf->cy + 1 + strlen(scr_number));
-  write(STDOUT_FILENO, esc_seq, strlen(esc_seq));
+  screen_clear(scr);
 
+  unsigned int text_lins = screen_text_lins(scr);
+  int cursor_y = 0, cursor_x = 0;
 
-  bytesread = read(STDIN_FILENO, &c_in, 1);
-
-  if (bytesread < 0) fatal_err("read error");
-  if (bytesread == 0) { // timed out
-    return -1;
+  if (buf->wrap) {
+    render_wrapped(buf, scr, text_lins, &cursor_y, &cursor_x);
+  } else {
+    render_rows(buf, scr, text_lins, &cursor_y, &cursor_x);
   }
 
-  else {
-    switch(c_in) {
-      default:
-        return c_in;
+  if (prompt.msg != NULL && scr->lins > 1) {
+    unsigned int x = screen_draw(scr, scr->lins - 1, 0, prompt.msg, strlen(prompt.msg), HL_NORMAL);
+    x = screen_draw(scr, scr->lins - 1, x, prompt.text, strlen(prompt.text), HL_NORMAL);
+    cursor_y = scr->lins - 1;
+    cursor_x = MIN(x, scr->cols - 1);
+  } else if (scr->lins > 1) {
+    char pos[64];
+    int n = sprintf(pos, "%d:%lu", buf->cx + 1, cursor_col(buf) + 1);
+    const char *msg = status_msg[0] == 0 && stats.overlay ? stats.line : status_msg;
+    screen_draw(scr, scr->lins - 1, 0, msg, strlen(msg), HL_LINE_NUMBER);
+    if (n < scr->cols) {
+      screen_draw(scr, scr->lins - 1, scr->cols - n, pos, n, HL_LINE_NUMBER);
     }
   }
-}
 
-void fatal_err(char *message) {
-  fprintf(stderr, "fatal error: %s\n", message);
-  exit(1);
+  if (render.on) {
+    render_publish(scr, view.line, text_lins, cursor_y, cursor_x);
+  } else {
+    screen_show(scr, view.line, text_lins, cursor_y, cursor_x);
+  }
+  STAT_END(STAT_RENDER);
 }
 
-void buffer_init(struct Buffer* buf) {
-  buf->size = 1;
-  buf->r_size = 10;
-
-  buf->rows = (char**) calloc(10, sizeof(char*));
-
-  buf->row_size = (unsigned long*) calloc(10, sizeof(unsigned long));
-
-  buf->r_row_size = (unsigned long*) calloc(10, sizeof(unsigned long));
-
-  buf->rows[0] = (char*) calloc(100, sizeof(char));
-  buf->r_row_size[0] = 100;
+static void cmd_move(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  switch (key->code) {
+    case K_UP: move_up(buf); break;
+    case K_DOWN: move_down(buf); break;
+    case K_LEFT: move_left(buf); break;
+    case K_RIGHT: move_right(buf); break;
+    case K_HOME: buf->cy = 0; break;
+    case K_END: buf->cy = row_len(&buffer_line(buf, buf->cx)->row); break;
+    case K_PGUP: move_page(buf, scr, -1); break;
+    case K_PGDN: move_page(buf, scr, 1); break;
+  }
 
-  buf->tabs = (int*) calloc(10, sizeof(int));
+  // typing somewhere else starts a new undo group
+  undo_close(&buf->undo);
 }
 
-void buffer_write(struct Buffer* buf, char c, struct Screen* scr) {
-
-  char ret_code = 13;
-  char nl = '\n';
-
+static void cmd_write(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  STAT_BEGIN(STAT_EDIT);
+  buffer_write(buf, key->code == 8 ? 127 : key->code);
+  STAT_END(STAT_EDIT);
+}
 
-  if (c == ret_code || c == nl) {
-    if (buf->size + 1 >= buf->r_size) {
-      int old_size = buf->r_size;
-      buf->r_size += 10;
+static void cmd_text(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  unsigned long r, col;
+  edit_insert(buf, buf->cx, buf->cy, key->text, key->len, &r, &col);
+  buf->cy = col;
+}
 
-      buf->rows = realloc(buf->rows, buf->r_size * sizeof(char*));
+// a paste goes in as one edit and one undo step, without the indent
+// typing would add
+static void cmd_paste(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  unsigned long n, r, col;
+  char *text = input_read_paste(&input, &n);
+
+  if (n > 0) {
+    undo_close(&buf->undo);
+    edit_insert(buf, buf->cx, buf->cy, text, n, &r, &col);
+    undo_close(&buf->undo);
+    buf->cx = r;
+    buf->cy = col;
+  }
+  free(text);
+}
 
-      buf->row_size = realloc(buf->row_size, buf->r_size * sizeof(unsigned long));
-      memset(buf->row_size+old_size, 0, buf->r_size-old_size);
+static void cmd_delete(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  buffer_index(buf, buf->cx + 2);
+  struct Line *line = buffer_line(buf, buf->cx);
+  unsigned long len = row_len(&line->row);
 
-      buf->r_row_size = realloc(buf->r_row_size, buf->r_size * sizeof(unsigned long));
-      memset(buf->r_row_size+old_size, 0, buf->r_size-old_size);
+  // the cluster under the cursor, or the newline joining the next line
+  if (buf->cy < len) {
+    edit_delete(buf, buf->cx, buf->cy, line_next(line, buf->cy) - buf->cy);
+  } else if (buf->cx + 1 < buf->size) {
+    edit_delete(buf, buf->cx, buf->cy, 1);
+  }
+}
 
-      buf->tabs = realloc(buf->tabs, buf->r_size * sizeof(int));
-      memset(buf->tabs+old_size, 0, buf->r_size-old_size);
-    }
+static void cmd_quit(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  quit_requested = 1;
+}
 
-    char tabstr[TAB_SIZE * 300] = "";
+static void cmd_save(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  double start = now_ms();
+  unsigned long bytes;
 
-    for (int i = 0; i < TAB_SIZE * MIN(buf->tabs[buf->cx], 300); ++i) {
-      strcat(tabstr, " ");
-    }
+  if (save_file(buf->filename, buf, &bytes) < 0) {
+    status_set("can't save %s: %s", buf->filename, strerror(errno));
+    return;
+  }
 
-    if (buf->cx != buf->size-1) {
-      memmove(&buf->rows[buf->cx + 2], &buf->rows[buf->cx + 1], (buf->size - buf->cx - 1 ) * sizeof(char*));
-      memmove(&buf->row_size[buf->cx + 2], &buf->row_size[buf->cx + 1], (buf->size - buf->cx - 1 ) * (sizeof(unsigned long)));
-      memmove(&buf->r_row_size[buf->cx + 2], &buf->r_row_size[buf->cx + 1], (buf->size - buf->cx - 1) * sizeof(unsigned long));
+  double ms = now_ms() - start;
+  status_set("saved %s, %.1f MB in %.0f ms (%.0f MB/s)", buf->filename, bytes / 1e6, ms,
+             bytes / 1e3 / MAX(ms, 0.001));
+}
 
-      buf->rows[buf->cx + 1] = (char*) malloc(100 * sizeof(char));
-      buf->r_row_size[buf->cx + 1] = 100;
+static void save_as_done(struct Buffer *buf, struct Screen *scr, const char *text) {
+  snprintf(buf->filename, sizeof(buf->filename), "%s", text);
+}
 
-      // write the correct number of tabs
-      strncpy(buf->rows[buf->cx + 1], tabstr, strlen(tabstr));
-      buf->row_size[buf->cx + 1] = strlen(tabstr);
+static void cmd_save_as(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  prompt_start("Save file as: ", save_as_done);
+}
 
-      // if cursor in middle of line copy contents after to that point
-      strncat(buf->rows[buf->cx + 1], buf->rows[buf->cx]+buf->cy, buf->row_size[buf->cx] - buf->cy);
-      buf->row_size[buf->cx + 1] += buf->row_size[buf->cx ] - buf->cy;
+static void goto_done(struct Buffer *buf, struct Screen *scr, const char *text) {
+  goto_line(buf, scr, strtoul(text, NULL, 10));
+  undo_close(&buf->undo);
+}
 
-      buf->row_size[buf->cx] = buf->cy;
+static void cmd_goto(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  prompt_start("Go to line: ", goto_done);
+}
 
-      // char row_size_msg[400];
-      // sprintf(row_size_msg, "row_size = %lu\n", buf->row_size[buf->cx + 1]);
-      // print_debug(row_size_msg);
+// the search prompt by direction and by what buffer_search() returned
+static const char *search_msg[2][3] = {
+  { "Search back (not found): ", "Search back: ", "Search back (wrapped): " },
+  { "Search (not found): ", "Search: ", "Search (wrapped): " },
+};
 
+// runs the search for text from line r, column col and moves the cursor
+// to the match, or back to where the search began if there is none
+static void search_run(struct Buffer *buf, const char *text, unsigned long r, unsigned long col) {
+  int res = buffer_search(buf, text, search.len, search.dir, r, col, &search.line, &search.col);
+
+  search.found = res != 0;
+  if (search.found) {
+    buf->cx = search.line;
+    buf->cy = search.col;
+  } else {
+    buf->cx = search.from_line;
+    buf->cy = search.from_col;
+    buf->top = search.from_top;
+    buf->top_sub = search.from_top_sub;
+  }
+  prompt.msg = search_msg[search.dir > 0][res];
+}
 
+// searches as the query is typed. A query one char longer than the last
+// can't match before the last match did, so the search goes on from
+// there, and not at all if the last query had no match
+static void search_change(struct Buffer *buf, struct Screen *scr, const char *text) {
+  unsigned long m = strlen(text);
+  int extended = search.len > 0 && m == search.len + 1 && memcmp(text, search.query, search.len) == 0;
 
-      // sprintf(row_size_msg, "row_size = %lu\n", buf->row_size[buf->cx + 1]);
-      // print_debug(row_size_msg);
+  memcpy(search.query, text, m + 1);
+  search.len = m;
 
-      char goto_erase_line[200];
-      sprintf(goto_erase_line, "\033[%d;0H", buf->cx);
+  if (extended && !search.found) {
+    return;
+  }
+  if (extended) {
+    search_run(buf, text, search.line, search.col);
+  } else {
+    search_run(buf, text, search.from_line, search.from_col);
+  }
+}
 
-      write(STDOUT_FILENO, goto_erase_line, strlen(goto_erase_line));
-      write(STDOUT_FILENO, "\033[0J", 4);
+// ctrl-w and ctrl-r in the search prompt go to the next and the
+// previous match
+static void search_key(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  unsigned long r = buf->cx, col = buf->cy;
+
+  search.len = strlen(prompt.text);
+  memcpy(search.query, prompt.text, search.len + 1);
+
+  if (key->code == 23) {
+    search.dir = 1;
+    search_run(buf, prompt.text, r, col + 1);
+  } else if (key->code == 18) {
+    search.dir = -1;
+    if (col > 0) {
+      col--;
+    } else if (r > 0) {
+      col = row_len(&buffer_line(buf, --r)->row);
+    } else {
+      r = ULONG_MAX; // nothing before the start, go round
     }
 
-    else {
-      if (buf->row_size[buf->cx + 1] + strlen(tabstr) >= buf->r_row_size[buf->cx + 1]) {
-        buf->rows[buf->cx + 1] = (char*) realloc(buf->rows[buf->cx + 1], sizeof(char) * (buf->r_row_size[buf->cx + 1] + 100));
-        memset(buf->rows+buf->cx + 1 + buf->r_row_size[buf->cx], 0, 100*sizeof(int));
-        buf->r_row_size[buf->cx + 1] += 100;
-      }
-
-      strncpy(buf->rows[buf->cx + 1], tabstr, strlen(tabstr));
-      buf->row_size[buf->cx + 1] = strlen(tabstr);
+    if (r == ULONG_MAX) {
+      buffer_index(buf, ULONG_MAX);
+      r = buf->size - 1;
+      col = row_len(&buffer_line(buf, r)->row);
     }
+    search_run(buf, prompt.text, r, col);
+  }
+}
 
-    // buf->row_size[buf->cx + 1] += strlen(tabstr);
-
-    buf->cx++;
-    buf->size++;
-
-    buf->tabs[buf->cx] = buf->cx > 0 ? buf->tabs[buf->cx-1] : 0;
-    buf->cy = buf->row_size[buf->cx];
-  } 
-
+static void search_done(struct Buffer *buf, struct Screen *scr, const char *text) {
+  search.show = 0;
+  undo_close(&buf->undo);
+}
 
-  else if (c == 127) { // backspace
-    if (buf->cy <= 0) {
-      return;
-    }
+static void search_cancel(struct Buffer *buf, struct Screen *scr, const char *text) {
+  search.show = 0;
+  buf->cx = search.from_line;
+  buf->cy = search.from_col;
+  buf->top = search.from_top;
+  buf->top_sub = search.from_top_sub;
+}
 
-    char tabstr[TAB_SIZE * 300] = "";
-    for (int i = 0; i < TAB_SIZE * MIN(300, buf->tabs[buf->cx]); ++i) {
-      strcat(tabstr, " ");
-    }
+// opens the search prompt with the last query in it
+static void search_start(struct Buffer *buf, int dir) {
+  prompt_start(search_msg[dir > 0][1], search_done);
+  prompt.change = search_change;
+  prompt.cancel = search_cancel;
+  prompt.key = search_key;
+
+  memcpy(prompt.text, search.query, search.len + 1);
+  search.from_line = buf->cx;
+  search.from_col = buf->cy;
+  search.from_top = buf->top;
+  search.from_top_sub = buf->top_sub;
+  search.dir = dir;
+  search.found = 0;
+  search.show = 1;
+}
 
-    if (strcmp(tabstr, buf->rows[buf->cx]) == 0 && buf->cy == buf->row_size[buf->cx]) {
-      buf->tabs[buf->cx]--;
-      buf->cy -= TAB_SIZE;
-      buf->row_size[buf->cx] -= TAB_SIZE;
-      buf->rows[buf->cx][buf->cy] = '\0';
-      return;
-    }
+static void cmd_search(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  search_start(buf, 1);
+}
 
-    else if (strncmp(tabstr, buf->rows[buf->cx], strlen(tabstr)) == 0 && buf->tabs[buf->cx] > 0 &&
-      strlen(tabstr) == buf->cy) {
-      // print_debug("getting into right place");
-      buf->tabs[buf->cx]--;
+static void cmd_search_back(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  search_start(buf, -1);
+}
 
-      // erase line
-      write(STDOUT_FILENO, "\033[2K", 4);
+static char replace_pattern[200];
 
-      memmove(buf->rows[buf->cx] + buf->cy - TAB_SIZE, buf->rows[buf->cx] + buf->cy, buf->row_size[buf->cx] - buf->cy + 1);
-      buf->cy -= TAB_SIZE;
-      buf->row_size[buf->cx] -= TAB_SIZE;
-      return;
-    }
+static void replace_with_done(struct Buffer *buf, struct Screen *scr, const char *text) {
+  char err[200];
+  double start = now_ms();
+  long n = buffer_replace(buf, replace_pattern, text, replace_jobs, err, sizeof(err));
 
-    buf->cy--;
-    buf->row_size[buf->cx]--;
-    
-    if (buf->cy < buf->row_size[buf->cx]) { // if cursor in middle of string
-      memmove(buf->rows[buf->cx]+buf->cy, buf->rows[buf->cx]+buf->cy+1, buf->row_size[buf->cx]-buf->cy);
-    } else { // if cursor in end of string
-      buf->rows[buf->cx][buf->cy] = '\0';
-    }
+  if (n < 0) {
+    status_set("bad regex: %s", err);
+    return;
+  }
+  struct Line *line = buffer_line(buf, buf->cx);
+  buf->cy = line_byte(line, line_col(line, MIN((unsigned long) buf->cy, row_len(&line->row))));
+  status_set("replaced %ld matches in %.0f ms", n, now_ms() - start);
+}
 
-    char esc_seq[100];
+static void replace_pattern_done(struct Buffer *buf, struct Screen *scr, const char *text) {
+  snprintf(replace_pattern, sizeof(replace_pattern), "%s", text);
+  prompt_start("Replace with: ", replace_with_done);
+}
 
-    int start = MAX(0, (int) buf->size - (int) scr->lins);
-    int rx = (int) buf->cx - start + 1;
-    sprintf(esc_seq, "\033[%d;%dH", rx, buf->cy);
-    write(STDOUT_FILENO, esc_seq, strlen(esc_seq));
-    write(STDOUT_FILENO, "\033[0K", 4);
-  } 
+static void cmd_replace(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  prompt_start("Replace regex: ", replace_pattern_done);
+}
 
-  else if (c == '\t') { // convert tabs to spaces
-    // fprintf(stderr, "\n\n\n%d %d", buf->row_size[buf->cx], buf->cy);
-    buf->tabs[buf->cx]++;
+static void cmd_journal(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  struct JournalStats st;
 
-    if (buf->row_size[buf->cx] + TAB_SIZE >= buf->r_row_size[buf->cx]) {
-      buf->r_row_size[buf->cx] += 100;
-      buf->rows[buf->cx] = realloc(buf->rows[buf->cx],
-                                   (buf->r_row_size[buf->cx]) * sizeof(char));
+  if (!journal.on) {
+    status_set("no journal");
+    return;
+  }
+  pthread_mutex_lock(&journal.lock);
+  st = journal.stats;
+  pthread_mutex_unlock(&journal.lock);
 
-    }
+  status_set("journal: %lu edits, %.1f MB at %.0f MB/s, %lu fsyncs max %.1f ms, lag max %.1f ms",
+             st.edits, st.bytes / 1e6, st.bytes / 1e3 / MAX(st.write_ms, 0.001), st.fsyncs,
+             st.fsync_max_ms, st.lag_max_ms);
+}
 
-    if (buf->row_size[buf->cx] == buf->cy) {
-      for (int i = 0; i < TAB_SIZE; ++i) {
-        strcat(buf->rows[buf->cx], " ");
-      }
-      buf->cy += TAB_SIZE;
-      buf->row_size[buf->cx] += TAB_SIZE;
+static void timer_stats(struct Buffer *buf, struct Screen *scr);
 
-    } else {
-      memmove(buf->rows[buf->cx]+buf->cy+TAB_SIZE, buf->rows[buf->cx]+buf->cy, buf->row_size[buf->cx]-buf->cy-1);
-      for (int i = buf->cy; i < buf->cy+TAB_SIZE; ++i) {
-        buf->rows[buf->cx][i] = ' ';
-      }
-      buf->cy += TAB_SIZE;
-      buf->row_size[buf->cx] += TAB_SIZE;
-    }
-    
+static void cmd_stats(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  if (!STATS) {
+    status_set("built without stats");
+    return;
   }
-  else { //writable chars
 
-    if (buf->row_size[buf->cx] + 1 >= buf->r_row_size[buf->cx]) {
-      buf->r_row_size[buf->cx] += 100;
-      buf->rows[buf->cx] = realloc(buf->rows[buf->cx],
-                                   (buf->r_row_size[buf->cx]) * sizeof(char));
-    }
+  stats.overlay = !stats.overlay;
+  loop.timer[TIMER_STATS] = 0;
+  if (stats.overlay) {
+    timer_stats(buf, scr);
+  }
+}
 
-    if (buf->row_size[buf->cx] == buf->cy) {
-      strncat(buf->rows[buf->cx], &c, 1);
-      buf->cy++;
-      buf->row_size[buf->cx]++;
+static void cmd_wrap(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  buf->wrap = !buf->wrap;
+  buf->left = 0;
+  buf->top_sub = 0;
+  status_set("%s long lines", buf->wrap ? "wrapping" : "not wrapping");
+}
 
-    } else {
-      memmove(buf->rows[buf->cx] + buf->cy + 1, buf->rows[buf->cx] + buf->cy, buf->row_size[buf->cx] - buf->cy+1);
-      buf->rows[buf->cx][buf->cy] = c;
-      buf->cy++;
-      buf->row_size[buf->cx]++;
-    }
+static void cmd_undo(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  if (!buffer_undo(buf)) {
+    status_set("nothing to undo");
   }
 }
 
-void handle_key(const char* str, struct Buffer* buf) {
-  if (!strcmp(str, "up")) {
-    if (buf->cx > 0) {
-      buf->cx--;
-      buf->cy = MIN(buf->cy, buf->row_size[buf->cx]);
-    }
-  } else if (!strcmp(str, "down")) {
-    if (buf->cx < buf->size - 1) {
-      buf->cx++;
-      buf->cy = MIN(buf->cy, buf->row_size[buf->cx]);
-    }
-  } else if (!strcmp(str, "left")) {
-    if (buf->cy > 0) {
-      buf->cy--;
-    }
-  } else if (!strcmp(str, "right")) {
-    if (buf->cy < buf->row_size[buf->cx]) {
-      buf->cy++;
-    }
+static void cmd_redo(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  if (!buffer_redo(buf)) {
+    status_set("nothing to redo");
   }
 }
 
-int save_file(const char* filename, struct Buffer* buf) {
-  FILE* file_pointer = fopen(filename, "w+");
+// what each key does; printable ascii all goes to cmd_write
+static key_handler cmd_table[K_COUNT] = {
+  ['\t'] = cmd_write,
+  ['\n'] = cmd_write,
+  ['\r'] = cmd_write,
+  [8] = cmd_write,   // ctrl-h, backspace on some terminals
+  [127] = cmd_write, // backspace
+  [5] = cmd_journal,  // ctrl-e
+  [6] = cmd_save_as,  // ctrl-f
+  [7] = cmd_goto,     // ctrl-g
+  [12] = cmd_wrap,    // ctrl-l
+  [15] = cmd_stats,   // ctrl-o
+  [18] = cmd_search_back, // ctrl-r
+  [19] = cmd_save,    // ctrl-s
+  [20] = cmd_replace, // ctrl-t
+  [23] = cmd_search,  // ctrl-w
+  [24] = cmd_quit,    // ctrl-x
+  [25] = cmd_redo,    // ctrl-y
+  [26] = cmd_undo,    // ctrl-z
+  [K_TEXT] = cmd_text,
+  [K_UP] = cmd_move,
+  [K_DOWN] = cmd_move,
+  [K_RIGHT] = cmd_move,
+  [K_LEFT] = cmd_move,
+  [K_HOME] = cmd_move,
+  [K_END] = cmd_move,
+  [K_PGUP] = cmd_move,
+  [K_PGDN] = cmd_move,
+  [K_DELETE] = cmd_delete,
+  [K_PASTE] = cmd_paste,
+};
 
-  if (file_pointer == NULL) {
-    fprintf(stderr, "Couldn't open file %s\n", filename);
-    return -2;
-  }
+void key_dispatch(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  key_handler handler = cmd_table[key->code];
 
-  for (int i = 0; i < buf->size; ++i) {
-    if (i > 0) {
-      if (fputs("\n", file_pointer) == EOF) {
-        fprintf(stderr, "Error while writing to file %s\n", filename);
-        return -1;
-      }
-    }
+  if (key->code >= ' ' && key->code < 127) {
+    handler = cmd_write;
+  }
+  // alt with a plain key isn't bound to anything
+  if ((key->mods & K_MOD_ALT) && key->code < K_TEXT) {
+    handler = NULL;
+  }
 
-    for (int j = 0; j < buf->row_size[i]; ++j) {
-      if (fputc(buf->rows[i][j], file_pointer) == EOF) {
-        fprintf(stderr, "Error while writing to file %s\n", filename);
-        return -1;
-      }
-    }
+  if (handler != NULL) {
+    handler(buf, scr, key);
   }
-  return 0;
 }
 
-void buffer_read(struct Buffer* buf, const char * filename) {
-  FILE *file = fopen(filename, "r");
-  if (file == NULL) {
-    fprintf(stderr, "Unable to open file %s\n", filename);
-    exit(1);
+// any key clears the last message, then goes to the prompt if one is
+// up and to the buffer otherwise
+static void loop_key(struct Buffer *buf, struct Screen *scr, const struct Key *key) {
+  STAT_BEGIN(STAT_INPUT);
+  status_msg[0] = 0;
+  loop.timer[TIMER_STATUS] = 0;
+
+  if (prompt.msg != NULL) {
+    prompt_key(buf, scr, key);
+  } else {
+    key_dispatch(buf, scr, key);
   }
+  loop.dirty = 1;
+  STAT_END(STAT_INPUT);
+}
 
-
-  int num_rows = 0;
-  char ch;
-  while ((ch = fgetc(file)) != EOF) {
-    if (ch == '\n') {
-      num_rows++;
-    }
+static void timer_esc(struct Buffer *buf, struct Screen *scr) {
+  struct Key key;
+  while (input_get_key(&input, &key, 1)) {
+    loop_key(buf, scr, &key);
   }
-  num_rows++;
-  // fprintf(stderr, "\n\nnum_rows = %i\n", num_rows);
-  // char dum;
-  // read(STDIN_FILENO, &dum, 1);
-  fseek(file, 0, SEEK_SET);
+}
+
+static void timer_status(struct Buffer *buf, struct Screen *scr) {
+  status_msg[0] = 0;
+  loop.dirty = 1;
+}
 
+static void timer_journal(struct Buffer *buf, struct Screen *scr) {
+  int err = journal_check(buf);
 
-  buf->rows = (char**) malloc(num_rows*sizeof(char*));
-  if (buf->rows == NULL) {
-    fprintf(stderr, "Failed to allocate memory\n");
-    exit(1);
+  loop.timer[TIMER_JOURNAL] = now_ms() + JOURNAL_CHECK_MS;
+  if (err != 0) {
+    status_set("journal %s: %s", journal.path, strerror(err));
+    loop.dirty = 1;
   }
+}
 
-  buf->row_size = (unsigned long*) malloc(num_rows*sizeof(unsigned long));
-  if (buf->row_size == NULL) {
-    fprintf(stderr, "Failed to allocate memory\n");
-    free(buf->rows);
-    exit(1);
+// redoes the overlay from what changed since it was last done, so it
+// shows the recent frames rather than the whole run
+static void timer_stats(struct Buffer *buf, struct Screen *scr) {
+  unsigned long calls[STAT_TIMERS], ns[STAT_TIMERS], count[STAT_COUNTERS];
+  double avg[STAT_TIMERS];
+
+  for (int k = 0; k < STAT_TIMERS; ++k) {
+    calls[k] = stats.timer[k].calls - stats.last_calls[k];
+    ns[k] = stats.timer[k].ns - stats.last_ns[k];
+    avg[k] = ns[k] / 1e6 / MAX(calls[k], 1UL);
+    stats.last_calls[k] += calls[k];
+    stats.last_ns[k] += ns[k];
+  }
+  for (int k = 0; k < STAT_COUNTERS; ++k) {
+    count[k] = stats.count[k] - stats.last_count[k];
+    stats.last_count[k] += count[k];
   }
 
-  buf->r_row_size = (unsigned long*) malloc(num_rows*sizeof(unsigned long));
-  if (buf->r_row_size == NULL) {
-    fprintf(stderr, "Failed to allocate memory\n");
-    free(buf->rows);
-    free(buf->row_size);
-    exit(1);
+  double frames = MAX(calls[STAT_FLUSH], 1UL);
+  snprintf(stats.line, sizeof(stats.line),
+           "render %.3f/%.3f hl %.3f flush %.3f key %.3f ms | %.1f alloc %.1f wr %.0f B /frame",
+           avg[STAT_RENDER], stats.timer[STAT_RENDER].max_ns / 1e6, avg[STAT_HIGHLIGHT],
+           avg[STAT_FLUSH], avg[STAT_INPUT], count[STAT_ALLOCS] / frames,
+           count[STAT_WRITES] / frames, count[STAT_WRITE_BYTES] / frames);
+
+  loop.dirty = 1;
+  loop.timer[TIMER_STATS] = now_ms() + STATS_OVERLAY_MS;
+}
+
+// writes the totals to --stats FILE as json
+static void stats_atexit(void) {
+  if (stats_write(stats.dump) < 0) {
+    fprintf(stderr, "can't write stats to %s: %s\n", stats.dump, strerror(errno));
   }
+}
+
+static void (*const timer_table[TIMER_COUNT])(struct Buffer *, struct Screen *) = {
+  [TIMER_ESC] = timer_esc,
+  [TIMER_STATUS] = timer_status,
+  [TIMER_JOURNAL] = timer_journal,
+  [TIMER_STATS] = timer_stats,
+};
+
+// runs the timers that are due
+static void loop_timers(struct Buffer *buf, struct Screen *scr) {
+  double now = now_ms();
 
-  buf->tabs = (int*) malloc(num_rows*sizeof(int));
-  if (buf->tabs == NULL) {
-    fprintf(stderr, "Failed to allocate memory\n");
-    free(buf->rows);
-    free(buf->row_size);
-    free(buf->r_row_size);
-    exit(1);
+  for (int k = 0; k < TIMER_COUNT; ++k) {
+    if (loop.timer[k] != 0 && loop.timer[k] <= now) {
+      loop.timer[k] = 0;
+      timer_table[k](buf, scr);
+    }
   }
+}
 
-  char *line = NULL;
-  size_t line_len = 0;
-  int i = 0;
-  ssize_t readSize;
+// runs until the quit key. Every key read is applied as soon as it is
+// whole, but a frame is drawn only once frame_ms passed since the last
+// one, so input coming faster than the terminal draws never queues up
+void event_loop(struct Buffer *buf, struct Screen *scr) {
+  struct pollfd pfd[2] = {
+    { .fd = STDIN_FILENO, .events = POLLIN },
+    { .fd = loop.winch_pipe[0], .events = POLLIN },
+  };
+  struct Key key;
+
+  loop.dirty = 1;
+  while (!quit_requested) {
+    while (!quit_requested && input_get_key(&input, &key, 0)) {
+      loop_key(buf, scr, &key);
+    }
+    if (quit_requested) {
+      break;
+    }
 
-  while ((readSize = getline(&line, &line_len, file)) != -1) {
-    if (line[readSize - 1] == '\n') {
-      line[readSize - 1] = '\0';
+    // bytes left over are a cut off sequence, maybe a lone escape
+    if (input.head == input.tail) {
+      loop.timer[TIMER_ESC] = 0;
+    } else if (loop.timer[TIMER_ESC] == 0) {
+      loop.timer[TIMER_ESC] = now_ms() + ESC_TIMEOUT_MS;
     }
 
+    double now = now_ms();
+    if (loop.dirty && now >= loop.last_frame + loop.frame_ms) {
+      render_buf(buf, scr);
+      loop.last_frame = now;
+      loop.dirty = 0;
+    }
 
+    // sleep until there is input, a resize, a timer or the next frame
+    double wake = loop.dirty ? loop.last_frame + loop.frame_ms : 0;
+    for (int k = 0; k < TIMER_COUNT; ++k) {
+      if (loop.timer[k] != 0 && (wake == 0 || loop.timer[k] < wake)) {
+        wake = loop.timer[k];
+      }
+    }
+    double left = wake - now_ms();
+    int timeout = wake == 0 ? -1 : left <= 0 ? 0 : (int) left + 1;
 
-    buf->rows[i] = (char*) malloc((readSize + 30) * sizeof(char));
-    if (buf->rows[i] == NULL) {
-      fclose(file);
-      free(line);
-      for (int j = 0; j < i; j++) {
-        free(buf->rows[j]);
+    if (poll(pfd, 2, timeout) < 0) {
+      if (errno != EINTR) {
+        fatal_err("poll error");
+      }
+    } else {
+      if (pfd[0].revents & POLLIN) {
+        input_fill(&input);
+      } else if (pfd[0].revents & (POLLHUP | POLLERR)) {
+        quit_requested = 1; // the terminal went away
+      }
+      if (pfd[1].revents & POLLIN) {
+        char drain[64];
+        while (read(loop.winch_pipe[0], drain, sizeof(drain)) > 0) {
+        }
+        loop.dirty = 1;
       }
-      free(buf->rows);
-      free(buf->row_size);
-      free(buf->r_row_size);
-      fprintf(stderr, "Failed to allocate data\n");
-      buf->rows = NULL;
-      buf->size = 0;
-      buf->r_size = 0;
     }
 
-    strcpy(buf->rows[i], line);
-    buf->row_size[i] = strlen(line);
-    buf->r_row_size[i] = readSize + 30;
-    i++;
+    loop_timers(buf, scr);
   }
+}
 
-  buf->size = num_rows;
-  buf->r_size = num_rows;
-  free(line);
-
-  fclose(file);
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
 }
 
-int main(int argc, char** argv) {
+// runs the keys in input.fd through the editor with no terminal, giving
+// each key a frame of its own, and reports how long each took from
+// being decoded to its frame being written, or handed to the render
+// thread if it runs
+void replay_loop(struct Buffer *buf, struct Screen *scr, const char *name, int render_thread) {
+  unsigned long n = 0, cap = 1024, big = 0;
+  double *ms = malloc(cap * sizeof(double));
+  double start = now_ms();
+  struct Key key;
+
+  if (ms == NULL) {
+    fatal_err("can't allocate key times");
+  }
 
-  if (!isatty(STDIN_FILENO))
-    fatal_err("fatal error: not on a tty");
+  render_buf(buf, scr);
+  unsigned long frames = frame.frames, bytes = frame.total_bytes;
 
-  if (tcgetattr(STDIN_FILENO, &orig_termios) < 0)
-    fatal_err("fatal error: can't get tty settings");
+  while (!quit_requested && !(input.eof && input.head == input.tail)) {
+    input_fill(&input);
 
-  if (atexit(tty_atexit) != 0)
-    fatal_err("atexit: can't register tty reset");
+    while (!quit_requested && input_get_key(&input, &key, input.eof)) {
+      double t = now_ms();
+      loop_key(buf, scr, &key);
+      render_buf(buf, scr);
+      loop.dirty = 0;
 
-  char filename[300] = "";
+      if (n == cap) {
+        cap *= 2;
+        if ((ms = realloc(ms, cap * sizeof(double))) == NULL) {
+          fatal_err("can't allocate key times");
+        }
+      }
+      ms[n++] = now_ms() - t;
+      big = MAX(big, frame.bytes);
+      loop_timers(buf, scr);
+    }
+  }
 
+  // the render thread counts the frames it writes
+  render_stop();
+  double total = now_ms() - start;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  frames = frame.frames - frames;
+  bytes = frame.total_bytes - bytes;
+
+  qsort(ms, n, sizeof(double), cmp_double);
+  fprintf(stderr, "%s%s: %lu keys in %.0f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms, "
+                  "%.0f B/frame (max %lu), peak RSS %.1f MB\n",
+          name, render_thread ? " (render thread)" : "", n, total, n ? ms[n / 2] : 0, n ? ms[MIN(n - 1, n * 99 / 100)] : 0,
+          n ? ms[n - 1] : 0, (double) bytes / MAX(frames, 1UL), big, ru.ru_maxrss / 1024.0);
+  free(ms);
+}
 
-  tty_raw();
-  write(STDOUT_FILENO, "\033[2J", 4);
-  write(STDOUT_FILENO, "\033[0;0H", 6);
+static void usage(FILE *out, const char *prog) {
+  fprintf(out, "usage: %s [--fps N] [--render-thread] [--jobs N] [--recover] [--record FILE]\n"
+               "       [--stats FILE] [--wrap] [file]\n"
+               "       %s --replay FILE [--size COLSxROWS] [--render-thread] [--jobs N]\n"
+               "       [--stats FILE] [--wrap] [file]\n"
+               "  --fps N          draw at most N frames a second (default %d)\n"
+               "  --render-thread  write frames from a thread of their own\n"
+               "  --jobs N         threads a regex replace runs on (default: cpus)\n"
+               "  --recover        apply the journal left by an editor that died to file\n"
+               "  --record FILE    copy the keys typed to FILE\n"
+               "  --replay FILE    run the keys in FILE with no terminal, a frame for each,\n"
+               "                   writing the frames to stdout and key latency to stderr;\n"
+               "                   edits aren't journaled\n"
+               "  --size COLSxROWS the screen --replay draws (default 80x24)\n"
+               "  --stats FILE     write the timers and counters to FILE as json on exit\n"
+               "  --wrap           wrap long lines instead of scrolling sideways (ctrl-l)\n",
+          prog, prog, FPS_DEFAULT);
+}
 
-  struct Screen* scr = malloc(sizeof(struct Screen));
+int main(int argc, char** argv) {
+  static const struct option long_opts[] = {
+    { "fps", required_argument, NULL, 'f' },
+    { "render-thread", no_argument, NULL, 'r' },
+    { "jobs", required_argument, NULL, 'j' },
+    { "recover", no_argument, NULL, 'R' },
+    { "record", required_argument, NULL, 'c' },
+    { "replay", required_argument, NULL, 'p' },
+    { "size", required_argument, NULL, 's' },
+    { "stats", required_argument, NULL, 'S' },
+    { "wrap", no_argument, NULL, 'w' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  int opt, render_thread = 0, recover = 0, wrap = 0;
+  const char *replay = NULL;
+  unsigned replay_cols = 80, replay_lins = 24;
+
+  replace_jobs = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+
+  while ((opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+    switch (opt) {
+      case 'f': {
+        int fps = atoi(optarg);
+        if (fps <= 0) {
+          fprintf(stderr, "bad --fps: %s\n", optarg);
+          return 1;
+        }
+        loop.frame_ms = 1000.0 / fps;
+        break;
+      }
+      case 'r':
+        render_thread = 1;
+        break;
+      case 'j':
+        replace_jobs = atoi(optarg);
+        if (replace_jobs <= 0) {
+          fprintf(stderr, "bad --jobs: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'R':
+        recover = 1;
+        break;
+      case 'c':
+        input.record = open(optarg, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (input.record < 0) {
+          fprintf(stderr, "can't record to %s: %s\n", optarg, strerror(errno));
+          return 1;
+        }
+        break;
+      case 'p':
+        replay = optarg;
+        break;
+      case 's': {
+        char x;
+        if (sscanf(optarg, "%u%c%u", &replay_cols, &x, &replay_lins) != 3 || x != 'x' ||
+            replay_cols == 0 || replay_lins == 0) {
+          fprintf(stderr, "bad --size: %s\n", optarg);
+          return 1;
+        }
+        break;
+      }
+      case 'S':
+        if (!STATS) {
+          fprintf(stderr, "--stats: built without stats\n");
+          return 1;
+        }
+        if (stats.dump == NULL && atexit(stats_atexit) != 0)
+          fatal_err("atexit: can't register the stats dump");
+        stats.dump = optarg;
+        break;
+      case 'w':
+        wrap = 1;
+        break;
+      case 'h':
+        usage(stdout, argv[0]);
+        return 0;
+      default:
+        usage(stderr, argv[0]);
+        return 1;
+    }
+  }
 
-  unsigned *lcol = get_term_lcol();
-  scr->lins = lcol[1];
-  scr->cols = lcol[0];
+  if (recover && optind >= argc) {
+    fprintf(stderr, "--recover needs a file\n");
+    return 1;
+  }
 
-  free(lcol);
+  if (replay != NULL) {
+    input.fd = open(replay, O_RDONLY | O_CLOEXEC);
+    if (input.fd < 0) {
+      fprintf(stderr, "can't open %s: %s\n", replay, strerror(errno));
+      return 1;
+    }
+  } else {
+    if (!isatty(STDIN_FILENO))
+      fatal_err("fatal error: not on a tty");
+
+    if (tcgetattr(STDIN_FILENO, &orig_termios) < 0)
+      fatal_err("fatal error: can't get tty settings");
+  }
 
+  hl_init();
+  newline_scan_init();
+  text_find_init();
+
+  // the file is loaded before the tty goes raw so its errors show
   struct Buffer *buf = (struct Buffer *)malloc(sizeof(struct Buffer));
   buf->cx = 0;
   buf->cy = 0;
 
 
   buffer_init(buf);
-
-  if (argc > 1) {
-    strcpy(filename, argv[1]);
-    if (access(filename, F_OK) == 0) { // file exists
-      buffer_read(buf, filename);
+  buf->wrap = wrap;
+
+  // a replay times the editor, not the disk
+  journal.off = replay != NULL;
+
+  if (optind < argc) {
+    snprintf(buf->filename, sizeof(buf->filename), "%s", argv[optind]);
+    if (recover) {
+      unsigned long edits = journal_recover(buf);
+      status_set("recovered %lu edits from %s", edits, journal.path);
+    } else if (journal_exists(buf->filename)) {
+      char path[sizeof(journal.path)];
+      journal_path(buf->filename, path, sizeof(path));
+      fprintf(stderr, "%s has unsaved edits in %s, run with --recover to apply them or remove it\n",
+              buf->filename, path);
+      return 1;
+    } else {
+      if (access(buf->filename, F_OK) == 0) { // file exists
+        buffer_read(buf, buf->filename);
+      }
+      journal_reset(buf);
     }
   }
+  loop.timer[TIMER_JOURNAL] = now_ms() + JOURNAL_CHECK_MS;
 
-  int w_limit = 500000;
-  int llimit = 0;
-  while (w_limit--) {
-    // tcgetattr(STDIN_FILENO, &orig_termios);
-    int i_inp;
-    char c_inp;
+  struct Screen* scr = calloc(1, sizeof(struct Screen));
+  screen_init_caps(scr);
 
-    llimit = render_buf(buf, scr, llimit);
-    i_inp = get_input(buf, scr);
-    if (i_inp == 24) { // ctr-x
-      break;
-    }
-
-    else if (i_inp == 6) {
-      const char* newfname = get_command("Save file as: ", scr);
-      write(STDOUT_FILENO, "\033[2J", 4);
-      strcpy(filename, newfname);
+  // a replay has no terminal to set up and draws inline, as fast as the
+  // keys go
+  if (replay != NULL) {
+    screen_resize(scr, replay_lins, replay_cols);
+    if (render_thread) {
+      render_start(scr);
     }
+    replay_loop(buf, scr, replay, render_thread);
+    journal_stop();
+    Buffer_dealocate(buf);
+    return 0;
+  }
 
-    else if ((char) i_inp == '\033') { // especial characters
-      char sec_char = get_input(buf, scr);
-      if (sec_char == '[') {
-        char third_char = get_input(buf, scr);
-        switch(third_char) {
-          case 'A':
-            handle_key("up", buf);
-            break;
-
-          case 'B':
-            handle_key("down", buf);
-            break;
-
-          case 'C':
-            handle_key("right", buf);
-            break;
-
-          case 'D':
-            handle_key("left", buf);
-            break;
-        } 
-      }
-    } 
-
-    else if (i_inp == 19) {
-      save_file(filename, buf);
-    } 
+  if (atexit(tty_atexit) != 0)
+    fatal_err("atexit: can't register tty reset");
 
-    else {
-      c_inp = (char) i_inp;
-      buffer_write(buf, c_inp, scr);
-    }
-    // tty_reset();
+  tty_raw();
+  frame_puts(&frame, "\033[?2004h"); // bracketed paste, sent with the first frame
+  screen_update_size(scr);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_winch;
+  sigemptyset(&sa.sa_mask);
+  if (pipe2(loop.winch_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    fatal_err("can't make the SIGWINCH pipe");
+  if (sigaction(SIGWINCH, &sa, NULL) < 0)
+    fatal_err("can't install SIGWINCH handler");
+
+  if (render_thread) {
+    render_start(scr);
   }
+  event_loop(buf, scr);
+  render_stop();
+  journal_stop();
 
   Buffer_dealocate(buf);
 
@@ -0,0 +1,542 @@
+#define _GNU_SOURCE
+
+#include <curses.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <term.h>
+#include <unistd.h>
+
+#include "editor.h"
+
+#define ANSI_RGB_COLOR_FORMAT "\033[38;2;%d;%d;%dm"
+#define ANSI_MATCH_COLOR_FORMAT "\033[30;48;2;%d;%d;%dm"
+#define FRAME_INIT_SIZE 16384
+
+const unsigned char highlight_rgb[][3] = {
+  [HL_NORMAL] = {0, 0, 0},
+  [HL_KEYWORD] = {255, 255, 51},
+  [HL_DATA_TYPE] = {0, 186, 155},
+  [HL_OPERAND] = {0, 255, 239},
+  [HL_LINE_NUMBER] = {203, 58, 255},
+  [HL_COMMENT] = {128, 128, 128},
+  [HL_STRING] = {255, 160, 64},
+  [HL_MATCH] = {255, 200, 0}
+};
+
+struct Frame frame = { .color = -1 };
+
+struct Render render;
+
+static const struct Cell blank_cell = { " ", HL_NORMAL };
+
+void frame_append(struct Frame *f, const char *s, size_t n) {
+  if (f->len + n > f->cap) {
+    size_t cap = f->cap ? f->cap : FRAME_INIT_SIZE;
+    while (cap < f->len + n) {
+      cap *= 2;
+    }
+
+    f->data = realloc(f->data, cap);
+    if (f->data == NULL) {
+      fatal_err("can't grow frame buffer");
+    }
+    f->cap = cap;
+  }
+
+  memcpy(f->data + f->len, s, n);
+  f->len += n;
+}
+
+void frame_puts(struct Frame *f, const char *s) {
+  frame_append(f, s, strlen(s));
+}
+
+// switch the terminal to the color of highlight, eliding the escape
+// sequence when that color is already in effect
+void frame_set_color(struct Frame *f, int highlight) {
+  if (f->color == highlight) {
+    return;
+  }
+
+  if (highlight == HL_NORMAL) {
+    frame_puts(f, ANSI_RESET_COLOR);
+  } else if (highlight == HL_MATCH) {
+    char color[40];
+    int n = sprintf(color, ANSI_MATCH_COLOR_FORMAT, highlight_rgb[highlight][0],
+                    highlight_rgb[highlight][1], highlight_rgb[highlight][2]);
+    frame_append(f, color, n);
+  } else {
+    if (f->color == HL_MATCH) {
+      frame_puts(f, ANSI_RESET_COLOR); // the foreground alone leaves the background
+    }
+    char color[32];
+    int n = sprintf(color, ANSI_RGB_COLOR_FORMAT, highlight_rgb[highlight][0],
+                    highlight_rgb[highlight][1], highlight_rgb[highlight][2]);
+    frame_append(f, color, n);
+  }
+
+  f->color = highlight;
+}
+
+void frame_flush(struct Frame *f) {
+  size_t off = 0;
+  STAT_BEGIN(STAT_FLUSH);
+
+  f->writes = 0;
+  f->bytes = 0;
+
+  while (off < f->len) {
+    ssize_t n = write(STDOUT_FILENO, f->data + off, f->len - off);
+    f->writes++;
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    off += n;
+  }
+
+  f->bytes = off;
+  f->len = 0;
+
+  f->frames++;
+  f->total_writes += f->writes;
+  f->total_bytes += f->bytes;
+  STAT_END(STAT_FLUSH);
+}
+
+void screen_resize(struct Screen *scr, unsigned int lins, unsigned int cols) {
+  if (scr->front != NULL && lins == scr->lins && cols == scr->cols) {
+    return;
+  }
+
+  size_t n = MAX((size_t) lins * cols, (size_t) 1);
+  scr->front = realloc(scr->front, n * sizeof(struct Cell));
+  scr->back = realloc(scr->back, n * sizeof(struct Cell));
+  if (scr->front == NULL || scr->back == NULL) {
+    fatal_err("can't allocate screen");
+  }
+
+  scr->lins = lins;
+  scr->cols = cols;
+  scr->redraw = 1;
+}
+
+void screen_clear(struct Screen *scr) {
+  size_t n = (size_t) scr->lins * scr->cols;
+  for (size_t i = 0; i < n; ++i) {
+    scr->back[i] = blank_cell;
+  }
+}
+
+// fills cell with the cluster of t in bytes [i, end), as much of it as
+// fits. Control chars and broken utf-8 show as U+FFFD, and a cluster
+// starting with a mark gets a blank to go on
+static void cell_put(struct Cell *cell, const struct RowText *t, unsigned long i,
+                     unsigned long end, int hl) {
+  char s[4];
+  int k = 0;
+
+  memset(cell->ch, 0, CELL_BYTES);
+  cell->hl = hl;
+  while (i < end) {
+    unsigned cp;
+    i += utf8_decode(t, i, end, &cp);
+    if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0)) {
+      cp = 0xfffd;
+    } else if (k == 0 && char_width(cp) == 0) {
+      cell->ch[k++] = ' ';
+    }
+
+    int n = utf8_encode(cp, s);
+    if (k + n > CELL_BYTES) {
+      break;
+    }
+    memcpy(cell->ch + k, s, n);
+    k += n;
+  }
+}
+
+// draws the row text t from byte *pos up to byte to at row y, where *col
+// is the row's display column at *pos and column left of the row shows
+// at screen column x. Columns left of left are skipped, and a cluster cut
+// by an edge of the screen shows as blanks. *pos and *col are moved past
+// what was drawn, which goes past to if to is inside a cluster. Returns 0
+// once the right edge of the screen is reached
+int screen_draw_text(struct Screen *scr, unsigned int y, unsigned int x, unsigned long left,
+                     const struct RowText *t, unsigned long *pos, unsigned long to,
+                     unsigned long *col, int hl) {
+  if (y >= scr->lins || x >= scr->cols) {
+    return 0;
+  }
+
+  struct Cell *row = scr->back + (size_t) y * scr->cols;
+  unsigned long len = t->alen + t->blen, right = left + scr->cols - x;
+
+  while (*pos < to && *col < right) {
+    int w;
+    unsigned long end = cluster_next(t, *pos, len, *col, &w);
+    unsigned char c = rt_at(t, *pos);
+
+    if (c == '\t' || *col < left || *col + w > right) {
+      for (unsigned long k = MAX(*col, left); k < MIN(*col + w, right); ++k) {
+        row[x + k - left] = blank_cell;
+      }
+    } else if (c >= ' ' && c < 0x7f && end == *pos + 1) {
+      // the color of a blank can't be seen, keep it out of the diff
+      row[x + *col - left] = (struct Cell) { { c }, c == ' ' ? HL_NORMAL : hl };
+    } else {
+      cell_put(&row[x + *col - left], t, *pos, end, hl);
+      if (w == 2) {
+        row[x + *col - left + 1] = (struct Cell) { { 0 }, hl };
+      }
+    }
+
+    *pos = end;
+    *col += w;
+  }
+
+  return *col < right;
+}
+
+// draws the n bytes of s at row y, column x of the frame being composed,
+// clipped to the screen width; returns the column after the last char
+unsigned int screen_draw(struct Screen *scr, unsigned int y, unsigned int x,
+                         const char *s, size_t n, int hl) {
+  struct RowText t = { s, n, NULL, 0 };
+  unsigned long pos = 0, col = x;
+
+  screen_draw_text(scr, y, 0, 0, &t, &pos, n, &col, hl);
+  return MIN(col, (unsigned long) scr->cols);
+}
+
+// lines of the screen showing text, the last one is the status line
+unsigned int screen_text_lins(const struct Screen *scr) {
+  return scr->lins > 1 ? scr->lins - 1 : 1;
+}
+
+// looks up the terminfo capabilities used to scroll, once at startup
+void screen_init_caps(struct Screen *scr) {
+  int err;
+  if (setupterm(NULL, STDOUT_FILENO, &err) == ERR) {
+    return;
+  }
+
+  const char *names[5] = { "csr", "indn", "rin", "ind", "ri" };
+  char *caps[5];
+  for (int k = 0; k < 5; ++k) {
+    caps[k] = tigetstr((char *) names[k]);
+    caps[k] = caps[k] == (char *) -1 || caps[k] == NULL ? NULL : strdup(caps[k]);
+  }
+
+  // without a scroll region or a way to scroll it, frames are repainted
+  if (caps[0] != NULL && ((caps[1] != NULL && caps[2] != NULL) ||
+                          (caps[3] != NULL && caps[4] != NULL))) {
+    scr->csr = caps[0];
+    scr->indn = caps[1];
+    scr->rin = caps[2];
+    scr->ind = caps[3];
+    scr->ri = caps[4];
+  }
+}
+
+static int cell_eq(struct Cell a, struct Cell b) {
+  return memcmp(&a, &b, sizeof(struct Cell)) == 0;
+}
+
+static int cell_blank(struct Cell c) {
+  return cell_eq(c, blank_cell);
+}
+
+// a cell that takes one column and one byte to send
+static int cell_ascii(struct Cell c) {
+  return c.ch[0] != 0 && (unsigned char) c.ch[0] < 0x80 && c.ch[1] == 0;
+}
+
+// moves the terminal cursor from (*cur_y, *cur_x) to (y, x), negative
+// coordinates meaning the cursor position is unknown
+static void screen_move(struct Screen *scr, struct Frame *f, int *cur_y, int *cur_x,
+                        int y, int x) {
+  char seq[32];
+  int n;
+
+  if (*cur_y == y && *cur_x == x) {
+    return;
+  }
+
+  if (*cur_y == y && *cur_x >= 0 && x > *cur_x) {
+    struct Cell *row = scr->back + (size_t) y * scr->cols;
+    int same_color = 1;
+    for (int i = *cur_x; i < x; ++i) {
+      if (!cell_ascii(row[i])) {
+        same_color = 0;
+      }
+      // blanks show the background, and a match has one of its own
+      if (row[i].hl != f->color && (!cell_blank(row[i]) || f->color == HL_MATCH)) {
+        same_color = 0;
+      }
+    }
+
+    // reprinting a few unchanged cells is cheaper than an escape sequence
+    if (x - *cur_x <= 3 && same_color) {
+      for (int i = *cur_x; i < x; ++i) {
+        frame_append(f, row[i].ch, 1);
+      }
+    } else {
+      n = sprintf(seq, "\033[%dC", x - *cur_x);
+      frame_append(f, seq, n);
+    }
+  } else {
+    n = sprintf(seq, "\033[%d;%dH", y + 1, x + 1);
+    frame_append(f, seq, n);
+  }
+
+  *cur_y = y;
+  *cur_x = x;
+}
+
+// appends a terminfo string, leaving out its $<..> padding delays
+static void frame_put_cap(struct Frame *f, const char *cap) {
+  while (*cap) {
+    const char *end = strstr(cap, "$<");
+    const char *close = end ? strchr(end, '>') : NULL;
+    if (close == NULL) {
+      frame_puts(f, cap);
+      return;
+    }
+    frame_append(f, cap, end - cap);
+    cap = close + 1;
+  }
+}
+
+// scrolls the top scr->scroll_lins lines of the terminal by scr->scroll
+// when enough of them already show what the frame has there, and shifts
+// front to match. Returns whether it scrolled
+static int screen_scroll(struct Screen *scr, struct Frame *f) {
+  int d = scr->scroll;
+  int region = MIN(scr->scroll_lins, scr->lins);
+  size_t row = scr->cols * sizeof(struct Cell);
+
+  if (d == 0 || scr->csr == NULL || abs(d) >= region) {
+    return 0;
+  }
+
+  // the lines that would be in place after scrolling
+  int kept = region - abs(d), same = 0;
+  for (int y = MAX(0, -d); y < MAX(0, -d) + kept; ++y) {
+    same += memcmp(scr->front + (size_t) (y + d) * scr->cols,
+                   scr->back + (size_t) y * scr->cols, row) == 0;
+  }
+  if (same * 2 < kept) {
+    return 0;
+  }
+
+  // lines scrolled in are cleared with the current background
+  frame_set_color(f, HL_NORMAL);
+  frame_puts(f, "\033[?25l");
+  frame_put_cap(f, tiparm(scr->csr, 0, region - 1));
+  if (scr->indn != NULL && scr->rin != NULL) {
+    frame_put_cap(f, tiparm(d > 0 ? scr->indn : scr->rin, abs(d)));
+  } else {
+    char seq[32];
+    frame_append(f, seq, sprintf(seq, "\033[%d;1H", d > 0 ? region : 1));
+    for (int k = 0; k < abs(d); ++k) {
+      frame_put_cap(f, d > 0 ? scr->ind : scr->ri);
+    }
+  }
+  frame_put_cap(f, tiparm(scr->csr, 0, scr->lins - 1));
+
+  struct Cell *front = scr->front;
+  if (d > 0) {
+    memmove(front, front + (size_t) d * scr->cols, kept * row);
+  } else {
+    memmove(front + (size_t) -d * scr->cols, front, kept * row);
+  }
+
+  struct Cell *blank = front + (size_t) (d > 0 ? kept : 0) * scr->cols;
+  for (size_t i = 0; i < (size_t) abs(d) * scr->cols; ++i) {
+    blank[i] = blank_cell;
+  }
+  return 1;
+}
+
+// sends the cells that differ between the frame being composed and what
+// the terminal shows, then leaves the cursor at (cursor_y, cursor_x)
+void screen_flush(struct Screen *scr, struct Frame *f, int cursor_y, int cursor_x) {
+  size_t n = (size_t) scr->lins * scr->cols;
+  int cur_y = -1, cur_x = -1;
+  int hidden = 0;
+  char seq[32];
+
+  if (scr->redraw) {
+    frame_set_color(f, HL_NORMAL);
+    frame_puts(f, "\033[?25l\033[2J");
+    hidden = 1;
+    for (size_t i = 0; i < n; ++i) {
+      scr->front[i] = blank_cell;
+    }
+    scr->redraw = 0;
+  } else if (screen_scroll(scr, f)) {
+    hidden = 1;
+  }
+  scr->scroll = 0;
+
+  for (int y = 0; y < scr->lins; ++y) {
+    struct Cell *fr = scr->front + (size_t) y * scr->cols;
+    struct Cell *bk = scr->back + (size_t) y * scr->cols;
+
+    if (memcmp(fr, bk, scr->cols * sizeof(struct Cell)) == 0) {
+      continue;
+    }
+
+    if (!hidden) {
+      frame_puts(f, "\033[?25l");
+      hidden = 1;
+    }
+
+    int end = scr->cols, fend = scr->cols;
+    while (end > 0 && cell_blank(bk[end - 1])) {
+      end--;
+    }
+    while (fend > 0 && cell_blank(fr[fend - 1])) {
+      fend--;
+    }
+
+    for (int x = 0; x < end; ++x) {
+      // the right half of a wide char goes out with its left half
+      if (cell_eq(fr[x], bk[x]) || bk[x].ch[0] == 0) {
+        continue;
+      }
+
+      screen_move(scr, f, &cur_y, &cur_x, y, x);
+      frame_set_color(f, bk[x].hl);
+      frame_append(f, bk[x].ch, strnlen(bk[x].ch, CELL_BYTES));
+      cur_x += x + 1 < scr->cols && bk[x + 1].ch[0] == 0 ? 2 : 1;
+    }
+
+    if (fend > end) {
+      screen_move(scr, f, &cur_y, &cur_x, y, end);
+      frame_set_color(f, HL_NORMAL);
+      frame_puts(f, "\033[K");
+    }
+
+    // the terminal won't say where the cursor went after the last column
+    if (cur_x >= (int) scr->cols) {
+      cur_y = cur_x = -1;
+    }
+
+    memcpy(fr, bk, scr->cols * sizeof(struct Cell));
+  }
+
+  cursor_y = MIN(MAX(cursor_y, 0), (int) scr->lins - 1);
+  cursor_x = MIN(MAX(cursor_x, 0), (int) scr->cols - 1);
+  int len = sprintf(seq, "\033[%d;%dH%s", cursor_y + 1, cursor_x + 1,
+                    hidden ? "\033[?25h" : "");
+  frame_append(f, seq, len);
+}
+
+// shows the frame composed in scr's back grid with the cursor at
+// cursor_y, cursor_x; top is the first text line in it, so a frame that
+// only moved the view can be scrolled instead of redrawn
+void screen_show(struct Screen *scr, unsigned long top, unsigned int text_lins,
+                 int cursor_y, int cursor_x) {
+  long moved = (long) top - (long) scr->drawn_top;
+  scr->scroll = MAX(MIN(moved, (long) text_lins), -(long) text_lins);
+  scr->scroll_lins = text_lins;
+  scr->drawn_top = top;
+
+  screen_flush(scr, &frame, cursor_y, cursor_x);
+  frame_flush(&frame);
+}
+
+// hands the composed frame to the render thread, dropping any it hasn't
+// drawn yet
+void render_publish(struct Screen *scr, unsigned long top, unsigned int text_lins,
+                    int cursor_y, int cursor_x) {
+  struct Snapshot *snap = &render.snap[render.back];
+  size_t n = (size_t) scr->lins * scr->cols;
+
+  if (n > snap->cap) {
+    snap->cells = realloc(snap->cells, n * sizeof(struct Cell));
+    if (snap->cells == NULL) {
+      fatal_err("can't allocate frame snapshot");
+    }
+    snap->cap = n;
+  }
+
+  memcpy(snap->cells, scr->back, n * sizeof(struct Cell));
+  snap->lins = scr->lins;
+  snap->cols = scr->cols;
+  snap->top = top;
+  snap->text_lins = text_lins;
+  snap->cursor_y = cursor_y;
+  snap->cursor_x = cursor_x;
+
+  render.back = atomic_exchange(&render.mid, render.back | SNAP_FRESH) & ~SNAP_FRESH;
+  sem_post(&render.wake);
+}
+
+static void *render_main(void *arg) {
+  struct Screen *scr = render.scr;
+
+  for (;;) {
+    while (sem_wait(&render.wake) < 0 && errno == EINTR) {
+    }
+    if (atomic_load(&render.stop)) {
+      break;
+    }
+    if (!(atomic_load(&render.mid) & SNAP_FRESH)) {
+      continue; // already drawn with an earlier wakeup
+    }
+
+    render.front = atomic_exchange(&render.mid, render.front) & ~SNAP_FRESH;
+    struct Snapshot *snap = &render.snap[render.front];
+
+    screen_resize(scr, snap->lins, snap->cols);
+    memcpy(scr->back, snap->cells, (size_t) snap->lins * snap->cols * sizeof(struct Cell));
+    screen_show(scr, snap->top, snap->text_lins, snap->cursor_y, snap->cursor_x);
+  }
+
+  return NULL;
+}
+
+// from now on frames are written by a thread of their own, so a slow
+// terminal doesn't hold up input. The render thread owns the frame buffer
+// and the terminal until render_stop()
+void render_start(const struct Screen *scr) {
+  render.scr = calloc(1, sizeof(struct Screen));
+  if (render.scr == NULL) {
+    fatal_err("can't allocate screen");
+  }
+  *render.scr = *scr;
+  render.scr->front = render.scr->back = NULL;
+  screen_resize(render.scr, scr->lins, scr->cols);
+
+  render.back = 0;
+  render.front = 1;
+  atomic_store(&render.mid, 2);
+  atomic_store(&render.stop, 0);
+  if (sem_init(&render.wake, 0, 0) < 0) {
+    fatal_err("can't make the render semaphore");
+  }
+  if (pthread_create(&render.thread, NULL, render_main, NULL) != 0) {
+    fatal_err("can't start the render thread");
+  }
+  render.on = 1;
+}
+
+// waits for the render thread to finish the frame it is on and stops it
+void render_stop(void) {
+  if (!render.on || pthread_equal(pthread_self(), render.thread)) {
+    return;
+  }
+
+  atomic_store(&render.stop, 1);
+  sem_post(&render.wake);
+  pthread_join(render.thread, NULL);
+  render.on = 0;
+}
@@ -0,0 +1,305 @@
+#define _GNU_SOURCE // memmem, memrchr
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "editor.h"
+
+#define SEARCH_BLOCK (1 << 24)
+
+// the substring finders return the first place in s[0..n) holding the m
+// chars of needle, or NULL. The vector ones test the first and the last
+// char of the needle at every position of a block at once and compare
+// the whole needle only where both matched, which rare strings seldom do
+static const char *text_find_scalar(const char *s, unsigned long n, const char *needle, unsigned long m) {
+  return memmem(s, n, needle, m);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static const char *text_find_sse2(const char *s, unsigned long n, const char *needle, unsigned long m) {
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  unsigned long i = 0;
+
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (s + i + m - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+    for (; mask != 0; mask &= mask - 1) {
+      const char *p = s + i + __builtin_ctz(mask);
+      if (memcmp(p, needle, m) == 0) {
+        return p;
+      }
+    }
+  }
+  return i < n ? text_find_scalar(s + i, n - i, needle, m) : NULL;
+}
+
+__attribute__((target("avx2")))
+static const char *text_find_avx2(const char *s, unsigned long n, const char *needle, unsigned long m) {
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+  unsigned long i = 0;
+
+  // two vectors a turn, tested together as they hardly ever match
+  for (; i + m - 1 + 64 <= n; i += 64) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i *) (s + i));
+    __m256i a1 = _mm256_loadu_si256((const __m256i *) (s + i + 32));
+    __m256i b0 = _mm256_loadu_si256((const __m256i *) (s + i + m - 1));
+    __m256i b1 = _mm256_loadu_si256((const __m256i *) (s + i + m - 1 + 32));
+    __m256i e0 = _mm256_and_si256(_mm256_cmpeq_epi8(a0, first), _mm256_cmpeq_epi8(b0, last));
+    __m256i e1 = _mm256_and_si256(_mm256_cmpeq_epi8(a1, first), _mm256_cmpeq_epi8(b1, last));
+    __m256i any = _mm256_or_si256(e0, e1);
+
+    if (_mm256_testz_si256(any, any)) {
+      continue;
+    }
+
+    unsigned long mask = (unsigned) _mm256_movemask_epi8(e0) |
+                         (unsigned long) (unsigned) _mm256_movemask_epi8(e1) << 32;
+    for (; mask != 0; mask &= mask - 1) {
+      const char *p = s + i + __builtin_ctzl(mask);
+      if (memcmp(p, needle, m) == 0) {
+        return p;
+      }
+    }
+  }
+  return i < n ? text_find_sse2(s + i, n - i, needle, m) : NULL;
+}
+#endif
+
+const char *(*text_find)(const char *, unsigned long, const char *, unsigned long) = text_find_scalar;
+
+// picks the widest substring finder the cpu runs
+void text_find_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    text_find = text_find_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    text_find = text_find_sse2;
+  }
+#endif
+}
+
+// the last place in s[0..n) holding the m chars of needle, or NULL
+static const char *text_rfind(const char *s, unsigned long n, const char *needle, unsigned long m) {
+  const char *p = s + n;
+
+  if (m > n) {
+    return NULL;
+  }
+
+  p -= m - 1;
+  while ((p = memrchr(s, needle[0], p - s)) != NULL) {
+    if (memcmp(p, needle, m) == 0) {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+// rows with their gap inside are copied here to be searched in one piece
+static char *flat;
+static size_t flat_cap;
+
+// the text of row in one piece, copied to the scratch buffer if the gap
+// is in the middle of it. It stays valid until the next call
+const char *row_flat(const struct Row *row) {
+  struct RowText t = row_text(row);
+
+  if (t.blen == 0) {
+    return t.a;
+  }
+  if (t.alen == 0) {
+    return t.b;
+  }
+
+  if (t.alen + t.blen > flat_cap) {
+    flat_cap = MAX(t.alen + t.blen, flat_cap * 2);
+    flat = realloc(flat, flat_cap);
+    if (flat == NULL) {
+      fatal_err("can't allocate search buffer");
+    }
+  }
+  memcpy(flat, t.a, t.alen);
+  memcpy(flat + t.alen, t.b, t.blen);
+  return flat;
+}
+// whether the mapped text at start is the line right after the one
+// ending at end. Rows of a file not edited lie one after another in the
+// mapping and are searched as one block
+static int map_adjacent(const char *end, const char *start) {
+  return (start == end + 1 && end[0] == '\n') ||
+         (start == end + 2 && end[0] == '\r' && end[1] == '\n');
+}
+
+// turns p, a place in the mapped text run starting at line r, column
+// col, into a line and a column
+static void run_locate(const char *run, const char *p, unsigned long r, unsigned long col,
+                       unsigned long *line, unsigned long *c) {
+  unsigned long nl = newline_count(run, p - run);
+
+  if (nl == 0) {
+    *line = r;
+    *c = col + (p - run);
+  } else {
+    *line = r + nl;
+    *c = p - ((const char *) memrchr(run, '\n', p - run) + 1);
+  }
+}
+
+// searches the part of the file not split into lines yet straight from
+// the mapping, dropping the pages read as it goes
+static int search_mapping(struct Buffer *buf, const char *q, unsigned long m,
+                          unsigned long *line, unsigned long *c) {
+  unsigned long page = sysconf(_SC_PAGESIZE);
+  const char *start = buf->map + buf->map_next;
+
+  for (unsigned long off = buf->map_next; !buf->indexed && off < buf->map_len; off += SEARCH_BLOCK) {
+    unsigned long n = MIN((unsigned long) SEARCH_BLOCK + m - 1, buf->map_len - off);
+    const char *p = text_find(buf->map + off, n, q, m);
+
+    if (p != NULL) {
+      run_locate(start, p, buf->size, 0, line, c);
+      buffer_index(buf, *line + 1);
+      return 1;
+    }
+
+    unsigned long from = off & ~(page - 1);
+    madvise((char *) buf->map + from, off + n - from, MADV_DONTNEED);
+  }
+  return 0;
+}
+
+// finds the first match of the m chars of q starting at or after line
+// r, column col, and no further down than line stop
+static int search_forward(struct Buffer *buf, const char *q, unsigned long m,
+                          unsigned long r, unsigned long col, unsigned long stop,
+                          unsigned long *line, unsigned long *c) {
+  const char *run = NULL, *run_end = NULL, *p;
+  unsigned long run_line = 0, run_col = 0;
+  struct LineIter it;
+
+  buffer_index(buf, r + 1);
+  struct Line *l = line_iter_start(buf, r, &it);
+
+  for (unsigned long i = r;; ++i, l = line_iter_next(&it)) {
+    const struct Row *row = l != NULL && i <= stop ? &l->row : NULL;
+
+    if (row != NULL && run != NULL && row->mapped && map_adjacent(run_end, row->data)) {
+      run_end = row->data + row_len(row);
+      continue;
+    }
+    if (run != NULL && (p = text_find(run, run_end - run, q, m)) != NULL) {
+      run_locate(run, p, run_line, run_col, line, c);
+      return 1;
+    }
+    run = NULL;
+    if (row == NULL) {
+      break;
+    }
+
+    unsigned long len = row_len(row);
+    unsigned long from = i == r ? MIN(col, len) : 0;
+    if (row->mapped) {
+      run = row->data + from;
+      run_end = row->data + len;
+      run_line = i;
+      run_col = from;
+      continue;
+    }
+
+    const char *t = row_flat(row);
+    if ((p = text_find(t + from, len - from, q, m)) != NULL) {
+      *line = i;
+      *c = p - t;
+      return 1;
+    }
+  }
+
+  return stop >= buf->size && search_mapping(buf, q, m, line, c);
+}
+
+// finds the last match of the m chars of q starting at or before line
+// r, column col, and no further up than line stop
+static int search_backward(struct Buffer *buf, const char *q, unsigned long m,
+                           unsigned long r, unsigned long col, unsigned long stop,
+                           unsigned long *line, unsigned long *c) {
+  const char *run = NULL, *run_end = NULL, *p;
+  unsigned long run_line = 0;
+  struct LineIter it;
+
+  buffer_index(buf, r + 1);
+  struct Line *l = line_iter_start(buf, r, &it);
+
+  for (unsigned long i = r;; --i, l = line_iter_prev(&it)) {
+    const struct Row *row = l != NULL && i + 1 > stop ? &l->row : NULL;
+
+    if (row != NULL && run != NULL && row->mapped && map_adjacent(row->data + row_len(row), run)) {
+      run = row->data;
+      run_line = i;
+      continue;
+    }
+    if (run != NULL && (p = text_rfind(run, run_end - run, q, m)) != NULL) {
+      run_locate(run, p, run_line, 0, line, c);
+      return 1;
+    }
+    run = NULL;
+    if (row == NULL) {
+      break;
+    }
+
+    // a match starting by col may go on past it
+    unsigned long len = row_len(row);
+    unsigned long upto = i == r ? MIN(col + m, len) : len;
+    if (row->mapped) {
+      run = row->data;
+      run_end = row->data + upto;
+      run_line = i;
+      continue;
+    }
+
+    const char *t = row_flat(row);
+    if ((p = text_rfind(t, upto, q, m)) != NULL) {
+      *line = i;
+      *c = p - t;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// finds the m chars of q from line r, column col on, forward if dir is
+// positive and backward if not, going round the end of the buffer if
+// need be. Returns 0 if there is no match, 1 if there is one and 2 if
+// it was found after going round
+int buffer_search(struct Buffer *buf, const char *q, unsigned long m, int dir,
+                  unsigned long r, unsigned long col, unsigned long *line, unsigned long *c) {
+  if (m == 0) {
+    return 0;
+  }
+
+  if (dir > 0) {
+    if (search_forward(buf, q, m, r, col, ULONG_MAX, line, c)) {
+      return 1;
+    }
+    return r + col > 0 && search_forward(buf, q, m, 0, 0, r, line, c) ? 2 : 0;
+  }
+
+  if (search_backward(buf, q, m, r, col, 0, line, c)) {
+    return 1;
+  }
+  buffer_index(buf, ULONG_MAX);
+  unsigned long last = buf->size - 1;
+  return search_backward(buf, q, m, last, row_len(&buffer_line(buf, last)->row), r, line, c) ? 2 : 0;
+}
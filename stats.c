@@ -0,0 +1,110 @@
+#include <errno.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "editor.h"
+
+struct Stats stats;
+
+static const char *const stat_timer_names[STAT_TIMERS] = {
+  "input", "edit", "render", "highlight", "flush", "read", "save"
+};
+
+static const char *const stat_counter_names[STAT_COUNTERS] = {
+  "allocs", "alloc_bytes", "frees", "writes", "write_bytes"
+};
+
+#if STATS && STATS_WRAP
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+void __real_free(void *);
+ssize_t __real_write(int, const void *, size_t);
+ssize_t __real_writev(int, const struct iovec *, int);
+
+void *__wrap_malloc(size_t n) {
+  STAT_ADD(STAT_ALLOCS, 1);
+  STAT_ADD(STAT_ALLOC_BYTES, n);
+  return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  STAT_ADD(STAT_ALLOCS, 1);
+  STAT_ADD(STAT_ALLOC_BYTES, n * size);
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t n) {
+  STAT_ADD(STAT_ALLOCS, 1);
+  STAT_ADD(STAT_ALLOC_BYTES, n);
+  return __real_realloc(p, n);
+}
+
+void __wrap_free(void *p) {
+  if (p != NULL) {
+    STAT_ADD(STAT_FREES, 1);
+  }
+  __real_free(p);
+}
+
+ssize_t __wrap_write(int fd, const void *s, size_t n) {
+  ssize_t w = __real_write(fd, s, n);
+  STAT_ADD(STAT_WRITES, 1);
+  STAT_ADD(STAT_WRITE_BYTES, MAX(w, 0));
+  return w;
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int n) {
+  ssize_t w = __real_writev(fd, iov, n);
+  STAT_ADD(STAT_WRITES, 1);
+  STAT_ADD(STAT_WRITE_BYTES, MAX(w, 0));
+  return w;
+}
+#endif
+
+// writes the totals to path as json; returns -1 with errno set if it
+// couldn't
+int stats_write(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return -1;
+  }
+
+  fprintf(f, "{\n  \"timers\": {\n");
+  for (int k = 0; k < STAT_TIMERS; ++k) {
+    unsigned long calls = stats.timer[k].calls, ns = stats.timer[k].ns;
+    fprintf(f, "    \"%s\": { \"calls\": %lu, \"total_ms\": %.3f, \"avg_ms\": %.6f, \"max_ms\": %.3f }%s\n",
+            stat_timer_names[k], calls, ns / 1e6, ns / 1e6 / MAX(calls, 1UL),
+            stats.timer[k].max_ns / 1e6, k < STAT_TIMERS - 1 ? "," : "");
+  }
+  fprintf(f, "  },\n  \"counters\": {\n");
+  for (int k = 0; k < STAT_COUNTERS; ++k) {
+    fprintf(f, "    \"%s\": %lu%s\n", stat_counter_names[k], (unsigned long) stats.count[k],
+            k < STAT_COUNTERS - 1 ? "," : "");
+  }
+
+  // the render thread is stopped by now, the journal writer may not be
+  unsigned long frames = MAX(frame.frames, 1UL);
+  fprintf(f, "  },\n  \"frames\": { \"frames\": %lu, \"writes\": %lu, \"bytes\": %lu, "
+             "\"writes_per_frame\": %.1f, \"bytes_per_frame\": %.1f },\n",
+          frame.frames, frame.total_writes, frame.total_bytes,
+          (double) frame.total_writes / frames, (double) frame.total_bytes / frames);
+
+  struct JournalStats js;
+  if (journal.on) {
+    pthread_mutex_lock(&journal.lock);
+  }
+  js = journal.stats;
+  if (journal.on) {
+    pthread_mutex_unlock(&journal.lock);
+  }
+  fprintf(f, "  \"journal\": { \"edits\": %lu, \"bytes\": %lu, \"writes\": %lu, \"mb_per_s\": %.1f, "
+             "\"fsyncs\": %lu, \"fsync_avg_ms\": %.3f, \"fsync_max_ms\": %.3f, "
+             "\"lag_avg_ms\": %.3f, \"lag_max_ms\": %.3f, \"snapshots\": %lu }\n}\n",
+          js.edits, js.bytes, js.writes, js.bytes / 1e3 / MAX(js.write_ms, 0.001),
+          js.fsyncs, js.fsync_ms / MAX(js.fsyncs, 1UL), js.fsync_max_ms,
+          js.lag_ms / MAX(js.writes, 1UL), js.lag_max_ms, js.snapshots);
+
+  return fclose(f) != 0 ? -1 : 0;
+}
@@ -0,0 +1,67 @@
+// checks the highlighter's word table and a few rows through the lexer:
+//   highlight_test
+// prints each failure and exits 1 if there were any. A word list edit that
+// makes hl_hash() collide fails here instead of leaving a word unhighlighted
+#include <stdio.h>
+#include <string.h>
+
+#include "editor.h"
+
+static int failed = 0;
+
+#define CHECK(cond, ...)                          \
+  do {                                            \
+    if (!(cond)) {                                \
+      printf("%s:%d: ", __FILE__, __LINE__);      \
+      printf(__VA_ARGS__);                        \
+      printf("\n");                               \
+      failed = 1;                                 \
+    }                                             \
+  } while (0)
+
+static void test_table(void) {
+  const char *w = hl_collision();
+  CHECK(w == NULL, "\"%s\" collides with another word in hl_hash(), pick new multipliers", w);
+
+  CHECK(is_highlight("while", 5) == HL_KEYWORD, "while is not a keyword");
+  CHECK(is_highlight("sizeof", 6) == HL_DATA_TYPE, "sizeof is not a data type");
+  CHECK(is_highlight("<<=", 3) == HL_OPERAND, "<<= is not an operand");
+  CHECK(is_highlight("whilst", 6) == HL_NORMAL, "whilst is highlighted");
+  CHECK(is_highlight("in", 2) == HL_NORMAL, "in is highlighted");
+}
+
+// the one span row s lexes to
+static void check_span(const char *s, unsigned long start, unsigned long len, int hl) {
+  struct RowText t = { s, strlen(s), NULL, 0 };
+  struct HlSpan spans[8];
+  int end_state;
+  int n = highlight_row(&t, 0, spans, 8, &end_state);
+
+  CHECK(n == 1, "%s: %d spans, want 1", s, n);
+  if (n == 1) {
+    CHECK(spans[0].start == start && spans[0].len == len && spans[0].hl == hl,
+          "%s: span %lu+%lu hl %d, want %lu+%lu hl %d", s, spans[0].start,
+          spans[0].len, spans[0].hl, start, len, hl);
+  }
+}
+
+static void test_rows(void) {
+  check_span("  return x", 2, 6, HL_KEYWORD);
+  check_span("x <<= 2", 2, 3, HL_OPERAND);
+
+  struct RowText t = { "returned", 8, NULL, 0 };
+  struct HlSpan spans[8];
+  int end_state;
+  CHECK(highlight_row(&t, 0, spans, 8, &end_state) == 0, "returned: highlighted");
+}
+
+int main(void) {
+  hl_init();
+  test_table();
+  test_rows();
+
+  if (!failed) {
+    printf("ok\n");
+  }
+  return failed;
+}
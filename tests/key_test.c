@@ -0,0 +1,178 @@
+// feeds byte streams to the key decoder and checks the keys it makes:
+//   key_test
+// prints each failure and exits 1 if there were any
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "editor.h"
+
+static int failed = 0;
+
+#define CHECK(cond, ...)                          \
+  do {                                            \
+    if (!(cond)) {                                \
+      printf("%s:%d: ", __FILE__, __LINE__);      \
+      printf(__VA_ARGS__);                        \
+      printf("\n");                               \
+      failed = 1;                                 \
+    }                                             \
+  } while (0)
+
+// appends the n bytes of s to the ring, as a read would
+static void feed(struct Input *in, const char *s, unsigned long n) {
+  for (unsigned long k = 0; k < n; ++k) {
+    in->ring[in->tail++ % INPUT_RING_SIZE] = s[k];
+  }
+}
+
+// the one key the whole of s decodes to
+static void check_key(const char *s, int code, int mods) {
+  struct Key key;
+  int n = strlen(s);
+  int used = key_parse((const unsigned char *) s, n, 0, &key);
+
+  CHECK(used == n, "%s: took %d of %d bytes", s + (s[0] == '\033'), used, n);
+  CHECK(key.code == code, "%s: code %d, want %d", s + (s[0] == '\033'), key.code, code);
+  CHECK(key.mods == mods, "%s: mods %d, want %d", s + (s[0] == '\033'), key.mods, mods);
+}
+
+static void check_text(const char *s) {
+  struct Key key;
+  int n = strlen(s);
+
+  CHECK(key_parse((const unsigned char *) s, n, 0, &key) == n, "utf-8 %s: not taken whole", s);
+  CHECK(key.code == K_TEXT && key.len == n && memcmp(key.text, s, n) == 0, "utf-8 %s: wrong key", s);
+}
+
+static void test_sequences(void) {
+  check_key("\033[A", K_UP, 0);
+  check_key("\033[B", K_DOWN, 0);
+  check_key("\033[C", K_RIGHT, 0);
+  check_key("\033[D", K_LEFT, 0);
+  check_key("\033[H", K_HOME, 0);
+  check_key("\033[F", K_END, 0);
+  check_key("\033OA", K_UP, 0);
+  check_key("\033OB", K_DOWN, 0);
+  check_key("\033OC", K_RIGHT, 0);
+  check_key("\033OD", K_LEFT, 0);
+  check_key("\033OH", K_HOME, 0);
+  check_key("\033OF", K_END, 0);
+
+  check_key("\033[1;5C", K_RIGHT, K_MOD_CTRL);
+  check_key("\033[1;2A", K_UP, K_MOD_SHIFT);
+  check_key("\033[1;3D", K_LEFT, K_MOD_ALT);
+  check_key("\033[1;6B", K_DOWN, K_MOD_CTRL | K_MOD_SHIFT);
+  check_key("\033[5;5~", K_PGUP, K_MOD_CTRL);
+
+  check_key("\033[1~", K_HOME, 0);
+  check_key("\033[7~", K_HOME, 0);
+  check_key("\033[4~", K_END, 0);
+  check_key("\033[8~", K_END, 0);
+  check_key("\033[5~", K_PGUP, 0);
+  check_key("\033[6~", K_PGDN, 0);
+  check_key("\033[2~", K_INSERT, 0);
+  check_key("\033[3~", K_DELETE, 0);
+  check_key("\033[200~", K_PASTE, 0);
+  check_key("\033[99~", K_UNKNOWN, 0);
+
+  check_key("a", 'a', 0);
+  check_key("\r", '\r', 0);
+  check_key("\177", 127, 0);
+  check_key("\030", 24, 0);
+  check_key("\033x", 'x', K_MOD_ALT);
+}
+
+static void test_utf8(void) {
+  struct Key key;
+
+  check_text("\xc3\xa9");             // é
+  check_text("\xe4\xb8\xad");         // 中
+  check_text("\xf0\x9f\x98\x80");     // 😀
+
+  // a broken char keeps what came before and the next byte starts afresh
+  CHECK(key_parse((const unsigned char *) "\xe4\xb8x", 3, 0, &key) == 2 && key.code == K_TEXT,
+        "broken utf-8 not cut at the bad byte");
+  CHECK(key_parse((const unsigned char *) "\x80", 1, 0, &key) == 1 && key.code == K_TEXT,
+        "a stray continuation byte is not a key of its own");
+}
+
+// a key cut off by the end of a read waits for the rest
+static void test_resume(void) {
+  struct Input in = { .fd = -1, .record = -1 };
+  struct Key key;
+
+  feed(&in, "\033[1;", 4);
+  CHECK(input_get_key(&in, &key, 0) == 0, "cut off csi taken before the rest came");
+  CHECK(in.head == 0, "cut off csi consumed");
+  feed(&in, "5Dq", 3);
+  CHECK(input_get_key(&in, &key, 0) == 1 && key.code == K_LEFT && key.mods == K_MOD_CTRL,
+        "resumed csi is not ctrl-left");
+  CHECK(input_get_key(&in, &key, 0) == 1 && key.code == 'q', "key after the resumed csi lost");
+
+  feed(&in, "\033O", 2);
+  CHECK(input_get_key(&in, &key, 0) == 0, "cut off ss3 taken before the rest came");
+  feed(&in, "A", 1);
+  CHECK(input_get_key(&in, &key, 0) == 1 && key.code == K_UP, "resumed ss3 is not up");
+
+  feed(&in, "\xf0\x9f", 2);
+  CHECK(input_get_key(&in, &key, 0) == 0, "cut off utf-8 taken before the rest came");
+  feed(&in, "\x98\x80", 2);
+  CHECK(input_get_key(&in, &key, 0) == 1 && key.code == K_TEXT && key.len == 4 &&
+        memcmp(key.text, "\xf0\x9f\x98\x80", 4) == 0, "resumed utf-8 is not the whole char");
+
+  CHECK(input_get_key(&in, &key, 0) == 0 && in.head == in.tail, "bytes left over");
+}
+
+// a lone escape could be the start of a sequence, only the escape
+// timeout makes it the escape key
+static void test_escape(void) {
+  struct Input in = { .fd = -1, .record = -1 };
+  struct Key key;
+
+  feed(&in, "\033", 1);
+  for (int k = 0; k < 3; ++k) {
+    CHECK(input_get_key(&in, &key, 0) == 0, "lone escape taken before the timeout");
+  }
+  CHECK(input_get_key(&in, &key, 1) == 1 && key.code == '\033' && key.mods == 0,
+        "lone escape is not the escape key after the timeout");
+  CHECK(in.head == in.tail, "escape not consumed");
+
+  // a sequence the timeout cuts off is taken as far as it goes
+  feed(&in, "\033[", 2);
+  CHECK(input_get_key(&in, &key, 0) == 0, "cut off csi taken before the timeout");
+  CHECK(input_get_key(&in, &key, 1) == 1 && in.head == in.tail, "cut off csi not dropped on timeout");
+
+  // an escape with a key behind it needs no timeout
+  feed(&in, "\033a", 2);
+  CHECK(input_get_key(&in, &key, 0) == 1 && key.code == 'a' && key.mods == K_MOD_ALT,
+        "escape before a key is not alt");
+}
+
+static void test_paste(void) {
+  struct Input in = { .fd = -1, .record = -1 };
+  struct Key key;
+  unsigned long len;
+  const char s[] = "\033[200~ab\r\ncd\ref\033[201~z";
+
+  feed(&in, s, sizeof(s) - 1);
+  CHECK(input_get_key(&in, &key, 0) == 1 && key.code == K_PASTE, "paste start not seen");
+
+  char *text = input_read_paste(&in, &len);
+  CHECK(len == 8 && memcmp(text, "ab\ncd\nef", 8) == 0, "paste text %.*s", (int) len, text);
+  free(text);
+  CHECK(input_get_key(&in, &key, 0) == 1 && key.code == 'z', "key after the paste lost");
+}
+
+int main(void) {
+  test_sequences();
+  test_utf8();
+  test_resume();
+  test_escape();
+  test_paste();
+
+  if (!failed) {
+    printf("ok\n");
+  }
+  return failed;
+}
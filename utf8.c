@@ -0,0 +1,437 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "editor.h"
+
+#define COL_INDEX_INIT 8
+
+struct Range {
+  unsigned first, last;
+};
+
+// chars drawn over the one before them: combining marks, zero width
+// spaces and joiners, variation selectors and the like
+static const struct Range zero_width[] = {
+  {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf},
+  {0x05c1, 0x05c2}, {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a},
+  {0x061c, 0x061c}, {0x064b, 0x065f}, {0x0670, 0x0670}, {0x06d6, 0x06dc},
+  {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0711, 0x0711},
+  {0x0730, 0x074a}, {0x07a6, 0x07b0}, {0x07eb, 0x07f3}, {0x0816, 0x082d},
+  {0x0859, 0x085b}, {0x08d3, 0x08e1}, {0x08e3, 0x0902}, {0x093a, 0x093a},
+  {0x093c, 0x093c}, {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957},
+  {0x0962, 0x0963}, {0x0981, 0x0981}, {0x09bc, 0x09bc}, {0x09c1, 0x09c4},
+  {0x09cd, 0x09cd}, {0x09e2, 0x09e3}, {0x0a01, 0x0a02}, {0x0a3c, 0x0a3c},
+  {0x0a41, 0x0a51}, {0x0a70, 0x0a71}, {0x0a75, 0x0a75}, {0x0a81, 0x0a82},
+  {0x0abc, 0x0abc}, {0x0ac1, 0x0ac8}, {0x0acd, 0x0acd}, {0x0ae2, 0x0ae3},
+  {0x0b01, 0x0b01}, {0x0b3c, 0x0b3c}, {0x0b3f, 0x0b3f}, {0x0b41, 0x0b44},
+  {0x0b4d, 0x0b4d}, {0x0b82, 0x0b82}, {0x0bc0, 0x0bc0}, {0x0bcd, 0x0bcd},
+  {0x0c3e, 0x0c40}, {0x0c46, 0x0c56}, {0x0cbc, 0x0cbc}, {0x0ccc, 0x0ccd},
+  {0x0d41, 0x0d44}, {0x0d4d, 0x0d4d}, {0x0dca, 0x0dca}, {0x0dd2, 0x0dd6},
+  {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x0eb1, 0x0eb1},
+  {0x0eb4, 0x0ebc}, {0x0ec8, 0x0ecd}, {0x0f18, 0x0f19}, {0x0f35, 0x0f35},
+  {0x0f37, 0x0f37}, {0x0f39, 0x0f39}, {0x0f71, 0x0f7e}, {0x0f80, 0x0f84},
+  {0x0f86, 0x0f87}, {0x0f8d, 0x0fbc}, {0x102d, 0x1030}, {0x1032, 0x1037},
+  {0x1039, 0x103a}, {0x1160, 0x11ff}, {0x135d, 0x135f}, {0x1712, 0x1714},
+  {0x17b4, 0x17b5}, {0x17b7, 0x17bd}, {0x17c6, 0x17c6}, {0x17c9, 0x17d3},
+  {0x180b, 0x180f}, {0x1a17, 0x1a18}, {0x1ab0, 0x1aff}, {0x1b00, 0x1b03},
+  {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x2064},
+  {0x20d0, 0x20f0}, {0x2cef, 0x2cf1}, {0x2de0, 0x2dff}, {0x302a, 0x302d},
+  {0x3099, 0x309a}, {0xa66f, 0xa672}, {0xa674, 0xa67d}, {0xa69e, 0xa69f},
+  {0xa6f0, 0xa6f1}, {0xa8e0, 0xa8f1}, {0xd7b0, 0xd7ff}, {0xfb1e, 0xfb1e},
+  {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0x1d167, 0x1d169},
+  {0x1d17b, 0x1d182}, {0x1d185, 0x1d18b}, {0x1d1aa, 0x1d1ad}, {0xe0001, 0xe0001},
+  {0xe0020, 0xe007f}, {0xe0100, 0xe01ef},
+};
+
+// chars taking two columns: east asian wide and fullwidth ones, emoji
+static const struct Range wide[] = {
+  {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec},
+  {0x23f0, 0x23f0}, {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615},
+  {0x2648, 0x2653}, {0x267f, 0x267f}, {0x2693, 0x2693}, {0x26a1, 0x26a1},
+  {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x26ce, 0x26ce},
+  {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+  {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b},
+  {0x2728, 0x2728}, {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755},
+  {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27b0, 0x27b0}, {0x27bf, 0x27bf},
+  {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55}, {0x2e80, 0x303e},
+  {0x3041, 0x3247}, {0x3250, 0x4dbf}, {0x4e00, 0xa4c6}, {0xa960, 0xa97c},
+  {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6b},
+  {0xff01, 0xff60}, {0xffe0, 0xffe6}, {0x16fe0, 0x16fe4}, {0x17000, 0x18cd5},
+  {0x1b000, 0x1b2fb}, {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e},
+  {0x1f191, 0x1f19a}, {0x1f200, 0x1f202}, {0x1f210, 0x1f23b}, {0x1f240, 0x1f248},
+  {0x1f250, 0x1f251}, {0x1f260, 0x1f265}, {0x1f300, 0x1f64f}, {0x1f680, 0x1f6ff},
+  {0x1f7e0, 0x1f7eb}, {0x1f90c, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd},
+  {0x30000, 0x3fffd},
+};
+
+static int in_ranges(const struct Range *r, int n, unsigned cp) {
+  int lo = 0, hi = n - 1;
+
+  if (cp < r[0].first || cp > r[n - 1].last) {
+    return 0;
+  }
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < r[mid].first) {
+      hi = mid - 1;
+    } else if (cp > r[mid].last) {
+      lo = mid + 1;
+    } else {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// decodes the char at byte i of the len bytes of t into *cp and returns
+// its length. A byte that doesn't start a well formed char is one of its
+// own, U+FFFD
+int utf8_decode(const struct RowText *t, unsigned long i, unsigned long len, unsigned *cp) {
+  unsigned char c = rt_at(t, i);
+  int n = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+  unsigned v = c & (0x7f >> n);
+
+  *cp = c;
+  if (c < 0x80) {
+    return 1;
+  }
+
+  *cp = 0xfffd;
+  if (c < 0xc2 || c > 0xf4 || i + n > len) {
+    return 1;
+  }
+  for (int k = 1; k < n; ++k) {
+    unsigned char b = rt_at(t, i + k);
+    if ((b & 0xc0) != 0x80) {
+      return 1;
+    }
+    v = v << 6 | (b & 0x3f);
+  }
+
+  // overlong forms, surrogates and past the last code point
+  if ((n == 3 && v < 0x800) || (n == 4 && (v < 0x10000 || v > 0x10ffff)) ||
+      (v >= 0xd800 && v <= 0xdfff)) {
+    return 1;
+  }
+
+  *cp = v;
+  return n;
+}
+
+int utf8_encode(unsigned cp, char *s) {
+  if (cp < 0x80) {
+    s[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    s[0] = 0xc0 | cp >> 6;
+    s[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  } else if (cp < 0x10000) {
+    s[0] = 0xe0 | cp >> 12;
+    s[1] = 0x80 | (cp >> 6 & 0x3f);
+    s[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+  s[0] = 0xf0 | cp >> 18;
+  s[1] = 0x80 | (cp >> 12 & 0x3f);
+  s[2] = 0x80 | (cp >> 6 & 0x3f);
+  s[3] = 0x80 | (cp & 0x3f);
+  return 4;
+}
+
+// columns cp takes on the terminal: 0 for chars drawn over the one
+// before, 2 for wide ones. Control chars are drawn as U+FFFD
+int char_width(unsigned cp) {
+  if (cp < 0x300) {
+    return 1;
+  }
+  if (in_ranges(zero_width, sizeof(zero_width) / sizeof(zero_width[0]), cp)) {
+    return 0;
+  }
+  return in_ranges(wide, sizeof(wide) / sizeof(wide[0]), cp) ? 2 : 1;
+}
+
+static int is_regional(unsigned cp) {
+  return cp >= 0x1f1e6 && cp <= 0x1f1ff;
+}
+
+// whether cp stays in the cluster of the chars before it
+static int char_extends(unsigned cp) {
+  return (cp >= 0x1f3fb && cp <= 0x1f3ff) || (cp >= 0x300 && char_width(cp) == 0);
+}
+
+// returns the end of the grapheme cluster starting at byte i of the len
+// bytes of t: a char and the marks, variation selectors and emoji
+// modifiers after it, chars joined by zwj, or a pair of flag letters.
+// *width gets the columns it takes when it starts at column col: those of
+// its first char but at least one, two for a flag, and up to the next
+// tab stop for a tab
+unsigned long cluster_next(const struct RowText *t, unsigned long i, unsigned long len,
+                           unsigned long col, int *width) {
+  unsigned char c = rt_at(t, i);
+
+  // ascii before ascii, almost all of any text, needs no decoding
+  if (c < 0x80 && (i + 1 >= len || (unsigned char) rt_at(t, i + 1) < 0x80)) {
+    *width = c == '\t' ? TAB_STOP - col % TAB_STOP : 1;
+    return i + 1;
+  }
+
+  unsigned cp, next;
+  unsigned long j = i + utf8_decode(t, i, len, &cp);
+  int pair = is_regional(cp);
+
+  *width = c == '\t' ? TAB_STOP - col % TAB_STOP : MAX(char_width(cp), 1);
+  while (j < len && (unsigned char) rt_at(t, j) >= 0x80) {
+    int n = utf8_decode(t, j, len, &next);
+    if (!char_extends(next) && cp != 0x200d && !(pair && is_regional(next))) {
+      break;
+    }
+    if (pair && is_regional(next)) { // a flag
+      *width = 2;
+    }
+    pair = 0;
+    cp = next;
+    j += n;
+  }
+  return j;
+}
+
+static struct ColMark cols_start = { 0, 0, 0 };
+
+// whether a flag letter starts at byte i. Which of them pair up depends
+// on how many come before, so no mark goes next to one: the columns
+// after a mark then stay the same whatever the edits before it did
+static int at_regional(const struct RowText *t, unsigned long i, unsigned long len) {
+  unsigned cp;
+  return i < len && (unsigned char) rt_at(t, i) == 0xf0 && (utf8_decode(t, i, len, &cp), is_regional(cp));
+}
+
+static void cols_push(struct Line *line, struct ColMark m) {
+  struct ColIndex *ix = line->cols;
+
+  if (ix->n == ix->cap) {
+    ix = realloc(ix, sizeof(struct ColIndex) + 2 * ix->cap * sizeof(struct ColMark));
+    if (ix == NULL) {
+      fatal_err("can't grow column index");
+    }
+    ix->cap *= 2;
+    line->cols = ix;
+  }
+  ix->mark[ix->n++] = m;
+}
+
+// whether the marks reach pos and col, ULONG_MAX for the one not wanted:
+// a mark at most COL_STEP bytes before pos, or one past col
+static int cols_reach(const struct ColMark *m, unsigned long pos, unsigned long col) {
+  return col == ULONG_MAX ? pos < m->pos + COL_STEP : col < m->col;
+}
+
+// scans on from the last mark, adding one every COL_STEP bytes or so,
+// until the marks reach pos and col or the row ends
+static void cols_extend(struct Line *line, unsigned long pos, unsigned long col) {
+  struct ColIndex *ix = line->cols;
+  struct ColMark m = ix->n > 0 ? ix->mark[ix->n - 1] : cols_start;
+
+  if (ix->done || cols_reach(&m, pos, col)) {
+    return;
+  }
+
+  struct RowText t = row_text(&line->row);
+  unsigned long len = t.alen + t.blen, i = m.pos, c = m.col;
+  int tab = 0;
+
+  while (i < len) {
+    int w, flag = at_regional(&t, i, len);
+    tab |= rt_at(&t, i) == '\t';
+    i = cluster_next(&t, i, len, c, &w);
+    c += w;
+
+    if (i >= m.pos + COL_STEP && i < len && !flag && !at_regional(&t, i, len)) {
+      m = (struct ColMark) { i, c, tab };
+      cols_push(line, m);
+      tab = 0;
+      if (cols_reach(&m, pos, col)) {
+        return;
+      }
+    }
+  }
+  line->cols->done = 1;
+}
+
+// the last mark at or before both pos and col, or the start of the row.
+// Rows shorter than COL_STEP get no index and are scanned from the start
+static struct ColMark cols_find(struct Line *line, unsigned long pos, unsigned long col) {
+  if (line->cols == NULL) {
+    if (row_len(&line->row) < COL_STEP) {
+      return cols_start;
+    }
+    line->cols = malloc(sizeof(struct ColIndex) + COL_INDEX_INIT * sizeof(struct ColMark));
+    if (line->cols == NULL) {
+      fatal_err("can't allocate column index");
+    }
+    line->cols->n = 0;
+    line->cols->cap = COL_INDEX_INIT;
+    line->cols->done = 0;
+  }
+  cols_extend(line, pos, col);
+
+  const struct ColIndex *ix = line->cols;
+  int lo = 0, hi = ix->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ix->mark[mid].pos <= pos && ix->mark[mid].col <= col) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo > 0 ? ix->mark[lo - 1] : cols_start;
+}
+
+// the display column of byte pos of the line, that of the cluster it
+// falls in if it is inside one
+unsigned long line_col(struct Line *line, unsigned long pos) {
+  struct ColMark m = cols_find(line, pos, ULONG_MAX);
+  struct RowText t = row_text(&line->row);
+  unsigned long len = t.alen + t.blen, i = m.pos, c = m.col;
+
+  while (i < pos) {
+    int w;
+    unsigned long end = cluster_next(&t, i, len, c, &w);
+    if (end > pos) {
+      break;
+    }
+    i = end;
+    c += w;
+  }
+  return c;
+}
+
+// the start of the cluster covering display column col of the line, or
+// the end of the line if it is shorter
+unsigned long line_byte(struct Line *line, unsigned long col) {
+  if (col == 0) {
+    return 0;
+  }
+
+  struct ColMark m = cols_find(line, ULONG_MAX, col);
+  struct RowText t = row_text(&line->row);
+  unsigned long len = t.alen + t.blen, i = m.pos, c = m.col;
+
+  while (i < len) {
+    int w;
+    unsigned long end = cluster_next(&t, i, len, c, &w);
+    if (c + w > col) {
+      break;
+    }
+    i = end;
+    c += w;
+  }
+  return i;
+}
+
+// the start of the cluster after the one at pos
+unsigned long line_next(struct Line *line, unsigned long pos) {
+  struct RowText t = row_text(&line->row);
+  unsigned long len = t.alen + t.blen;
+  int w;
+
+  return pos < len ? cluster_next(&t, pos, len, 0, &w) : len;
+}
+
+// the start of the cluster before pos
+unsigned long line_prev(struct Line *line, unsigned long pos) {
+  if (pos == 0) {
+    return 0;
+  }
+
+  struct ColMark m = cols_find(line, pos - 1, ULONG_MAX);
+  struct RowText t = row_text(&line->row);
+  unsigned long len = t.alen + t.blen, i = m.pos, c = m.col;
+
+  for (;;) {
+    int w;
+    unsigned long end = cluster_next(&t, i, len, c, &w);
+    if (end >= pos) {
+      return i;
+    }
+    i = end;
+    c += w;
+  }
+}
+
+// keeps the column index of the line right after del bytes at pos were
+// replaced with ins. Marks before pos stay; the text from the last of
+// them up to the first mark past the edit is rescanned, and the marks
+// after that move by what it gained or lost. A tab after the edit is
+// only moved when the columns moved a whole tab stop; the marks from
+// there on are dropped and made again when they are needed
+void line_cols_edit(struct Line *line, unsigned long pos, unsigned long del, unsigned long ins) {
+  struct ColIndex *ix = line->cols;
+  if (ix == NULL) {
+    return;
+  }
+  ix->done = 0;
+
+  // whether a cluster ends at a mark can hang on the three bytes after
+  // it, when they make or break a utf-8 char
+  int keep = 0, k;
+  while (keep < ix->n && ix->mark[keep].pos + 4 <= pos) {
+    keep++;
+  }
+  for (k = keep; k < ix->n && ix->mark[k].pos <= pos + del; ++k) {
+  }
+
+  int tail = ix->n - k;
+  ix->n = keep;
+  if (tail == 0) {
+    return;
+  }
+
+  struct ColMark *moved = malloc(tail * sizeof(struct ColMark));
+  if (moved == NULL) {
+    fatal_err("can't allocate column index");
+  }
+  memcpy(moved, ix->mark + k, tail * sizeof(struct ColMark));
+
+  struct RowText t = row_text(&line->row);
+  struct ColMark m = keep > 0 ? ix->mark[keep - 1] : cols_start;
+  unsigned long len = t.alen + t.blen, i = m.pos, c = m.col, last = m.pos;
+  int tab = 0, first = 0;
+
+  while (first < tail && i < len) {
+    unsigned long target = moved[first].pos + ins - del;
+    if (i > target) { // a cluster runs over it now
+      first++;
+      continue;
+    }
+    if (i == target) {
+      break;
+    }
+
+    int w, flag = at_regional(&t, i, len);
+    tab |= rt_at(&t, i) == '\t';
+    i = cluster_next(&t, i, len, c, &w);
+    c += w;
+    if (i >= last + COL_STEP && i < target && !flag && !at_regional(&t, i, len)) {
+      cols_push(line, (struct ColMark) { i, c, tab });
+      last = i;
+      tab = 0;
+    }
+  }
+
+  if (first < tail && i < len) {
+    long dcol = (long) c - (long) moved[first].col;
+    moved[first].after_tab = tab;
+
+    for (int j = first; j < tail; ++j) {
+      // the columns after a tab depend on where it starts
+      if (j > first && moved[j].after_tab && dcol % TAB_STOP != 0) {
+        break;
+      }
+      cols_push(line, (struct ColMark) { moved[j].pos + ins - del, moved[j].col + dcol, moved[j].after_tab });
+    }
+  }
+  free(moved);
+}
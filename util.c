@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "editor.h"
+
+void fatal_err(char *message) {
+  fprintf(stderr, "fatal error: %s\n", message);
+  exit(1);
+}
+
+double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int write_full(int fd, const char *s, unsigned long n) {
+  while (n > 0) {
+    ssize_t w = write(fd, s, n);
+    if (w < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    s += w;
+    n -= w;
+  }
+  return 0;
+}
+
+// fsyncs the directory holding filename so a rename in it is durable
+int fsync_dir(const char *filename) {
+  char dir[strlen(filename) + 2];
+  strcpy(dir, filename);
+
+  char *slash = strrchr(dir, '/');
+  if (slash == NULL) {
+    strcpy(dir, ".");
+  } else {
+    slash[slash == dir] = 0; // keep the root's slash
+  }
+
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return -1;
+  }
+  int r = fsync(fd);
+  close(fd);
+  return r;
+}
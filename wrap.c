@@ -0,0 +1,222 @@
+#include <limits.h>
+#include <stdlib.h>
+
+#include "editor.h"
+
+#define WRAP_INIT 4
+
+static int is_blank(char c) {
+  return c == ' ' || c == '\t';
+}
+
+static void wrap_push(struct Line *line, unsigned long pos) {
+  struct Wrap *w = line->wrap;
+
+  if (w->n == w->cap) {
+    w = realloc(w, sizeof(struct Wrap) + 2 * w->cap * sizeof(unsigned long));
+    if (w == NULL) {
+      fatal_err("can't grow wrap layout");
+    }
+    w->cap *= 2;
+    line->wrap = w;
+  }
+  w->brk[w->n++] = pos;
+}
+
+// the columns of the cluster at byte i of t that starts column col of a
+// screen line width wide; a tab stops at the right edge
+static int wrap_width(const struct RowText *t, unsigned long i, unsigned long len,
+                      unsigned long col, unsigned int width, unsigned long *end) {
+  int w;
+  *end = cluster_next(t, i, len, col, &w);
+  return rt_at(t, i) == '\t' ? MIN((unsigned long) w, width - col) : (unsigned long) w;
+}
+
+// works out the breaks of line for screen lines width columns wide until
+// screen line k and the one holding byte pos are known, or the row ends.
+// Lines break after the last blank that fits, or else before the first
+// cluster that doesn't; a row that fills its last line gets an empty one
+// after it for the cursor
+static struct Wrap *wrap_extend(struct Line *line, unsigned int width, unsigned long pos, int k) {
+  struct Wrap *w = line->wrap;
+
+  if (w == NULL) {
+    w = malloc(sizeof(struct Wrap) + WRAP_INIT * sizeof(unsigned long));
+    if (w == NULL) {
+      fatal_err("can't allocate wrap layout");
+    }
+    w->cap = WRAP_INIT;
+    w->width = 0;
+    line->wrap = w;
+  }
+  if (w->width != width) {
+    w->width = width;
+    w->n = 0;
+    w->done = 0;
+  }
+
+  struct RowText t = row_text(&line->row);
+  unsigned long len = t.alen + t.blen;
+  unsigned long start = w->n > 0 ? w->brk[w->n - 1] : 0, i = start, blank = start, col = 0;
+
+  while (!line->wrap->done && (line->wrap->n < k || start <= pos)) {
+    if (i >= len) {
+      if (col == width && start < len) {
+        wrap_push(line, len);
+      }
+      line->wrap->done = 1;
+      break;
+    }
+
+    unsigned long end;
+    int cw = wrap_width(&t, i, len, col, width, &end);
+    if (col + cw > width && i > start) {
+      start = blank > start ? blank : i;
+      wrap_push(line, start);
+      i = blank = start;
+      col = 0;
+      continue;
+    }
+
+    col += cw;
+    i = end;
+    if (is_blank(rt_at(&t, i - 1))) {
+      blank = i;
+    }
+  }
+  return line->wrap;
+}
+
+// the screen lines the row takes when wrapped at width
+int wrap_count(struct Line *line, unsigned int width) {
+  return wrap_extend(line, width, ULONG_MAX, 0)->n + 1;
+}
+
+// whether the row has a screen line k when wrapped at width
+int wrap_has(struct Line *line, unsigned int width, int k) {
+  return wrap_extend(line, width, 0, k)->n >= k;
+}
+
+// the screen line of the row holding byte pos
+int wrap_find(struct Line *line, unsigned int width, unsigned long pos) {
+  struct Wrap *w = wrap_extend(line, width, pos, 0);
+  int lo = 0, hi = w->n;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (w->brk[mid] <= pos) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// where screen line k of the row starts, and the end of its bytes
+unsigned long wrap_start(struct Line *line, unsigned int width, int k) {
+  struct Wrap *w = wrap_extend(line, width, 0, k);
+  return k == 0 ? 0 : w->brk[MIN(k, w->n) - 1];
+}
+
+unsigned long wrap_end(struct Line *line, unsigned int width, int k) {
+  struct Wrap *w = wrap_extend(line, width, 0, k + 1);
+  return k < w->n ? w->brk[k] : row_len(&line->row);
+}
+
+// the column of byte pos in screen line k of the row
+unsigned long wrap_col(struct Line *line, unsigned int width, int k, unsigned long pos) {
+  struct RowText t = row_text(&line->row);
+  unsigned long len = t.alen + t.blen, i = wrap_start(line, width, k), col = 0;
+
+  while (i < pos) {
+    unsigned long end;
+    int cw = wrap_width(&t, i, len, col, width, &end);
+    if (end > pos) {
+      break;
+    }
+    col += cw;
+    i = end;
+  }
+  return col;
+}
+
+// the cluster at column col of screen line k of the row. Past the end of
+// a line that wraps that is its last cluster, so the cursor stays on it
+unsigned long wrap_byte(struct Line *line, unsigned int width, int k, unsigned long col) {
+  struct RowText t = row_text(&line->row);
+  unsigned long len = t.alen + t.blen, i = wrap_start(line, width, k), c = 0;
+  unsigned long stop = wrap_end(line, width, k), last = i;
+
+  while (i < stop) {
+    unsigned long end;
+    int cw = wrap_width(&t, i, len, c, width, &end);
+    if (c + cw > col) {
+      return i;
+    }
+    last = i;
+    c += cw;
+    i = end;
+  }
+  return stop < len || wrap_has(line, width, k + 1) ? last : i;
+}
+
+// drops the breaks an edit at pos may have moved: those from the screen
+// line before the edit on, as its last word may fit there now. A break
+// hangs on the three bytes after it as well, when they make or break a
+// utf-8 char
+void line_wrap_edit(struct Line *line, unsigned long pos) {
+  struct Wrap *w = line->wrap;
+  if (w == NULL) {
+    return;
+  }
+
+  int keep = 0;
+  while (keep < w->n && w->brk[keep] + 4 <= pos) {
+    keep++;
+  }
+  w->n = MAX(keep - 1, 0);
+  w->done = 0;
+}
+
+// moves (*row, *sub), a row and a screen line of it, one screen line up
+// or down in wrap mode. Returns 0 at the start or end of the buffer
+int wrap_step(struct Buffer *buf, unsigned long *row, int *sub, int dir) {
+  unsigned int width = buf->wrap_cols;
+
+  if (dir < 0) {
+    if (*sub > 0) {
+      (*sub)--;
+    } else if (*row > 0) {
+      (*row)--;
+      *sub = wrap_count(buffer_line(buf, *row), width) - 1;
+    } else {
+      return 0;
+    }
+    return 1;
+  }
+
+  if (wrap_has(buffer_line(buf, *row), width, *sub + 1)) {
+    (*sub)++;
+    return 1;
+  }
+  buffer_index(buf, *row + 2);
+  if (*row + 1 >= buf->size) {
+    return 0;
+  }
+  (*row)++;
+  *sub = 0;
+  return 1;
+}
+
+// screen lines from (row, sub) down to (to_row, to_sub), at most max
+int wrap_distance(struct Buffer *buf, unsigned long row, int sub,
+                  unsigned long to_row, int to_sub, int max) {
+  int n = 0;
+
+  while (n < max && (row < to_row || (row == to_row && sub < to_sub)) &&
+         wrap_step(buf, &row, &sub, 1)) {
+    n++;
+  }
+  return n;
+}